@@ -0,0 +1,113 @@
+#pragma once
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <system_error>
+#include <tuple>
+#include <utility>
+
+#include "outcome.hh"
+
+/// boost::asio::error::misc_errors, the errors of asio's own category
+enum class AsioErrc : int {
+  already_open = boost::asio::error::already_open,
+  eof = boost::asio::error::eof,
+  not_found = boost::asio::error::not_found,
+  fd_set_failure = boost::asio::error::fd_set_failure,
+};
+
+QUICK_STATUS_CODE(AsioErrc, already_open, eof, not_found, fd_set_failure)
+
+/**
+ * The failure of a Result for an asio error_code. Errno values become
+ * GenericErrc and asio's own errors AsioErrc, both as quick status codes
+ * which fit in the Result without an allocation, so the frequent eof and
+ * operation_canceled failures stay cheap. Errors of any other category keep
+ * their error_code in an Anyhow error.
+ */
+template <typename T>
+Result<T> asio_failure(const boost::system::error_code &ec) {
+  const auto &category = ec.category();
+  if (category == boost::system::system_category() ||
+      category == boost::system::generic_category()) {
+    if (auto errc = errno_to_errc(ec.value()); errc != GenericErrc::unknown) {
+      return errc;
+    }
+  } else if (category == boost::asio::error::get_misc_category()) {
+    return static_cast<AsioErrc>(ec.value());
+  }
+  return make_error(static_cast<std::error_code>(ec));
+}
+
+/**
+ * Completion token for asio operations awaited in a coroutine, which then
+ * resume with a Result instead of throwing system_error:
+ *
+ *   CO_TRY(auto n, co_await socket.async_read_some(buffer, use_result));
+ *
+ * An operation completing with no value yields Result<void>, with one value
+ * Result<T>, and with several a Result of their tuple.
+ */
+struct UseResult {};
+
+inline constexpr UseResult use_result{};
+
+namespace detail {
+
+template <typename... Args>
+struct AsioResult {
+  using type = Result<std::tuple<Args...>>;
+};
+
+template <>
+struct AsioResult<> {
+  using type = Result<void>;
+};
+
+template <typename T>
+struct AsioResult<T> {
+  using type = Result<T>;
+};
+
+}  // namespace detail
+
+template <typename... Args>
+class boost::asio::async_result<UseResult,
+                                void(boost::system::error_code, Args...)> {
+public:
+  using result_type = typename ::detail::AsioResult<Args...>::type;
+  using return_type = boost::asio::awaitable<result_type>;
+
+  // the operation runs as a nested awaitable with the error redirected into
+  // `ec`, asio recycles the frames of nested awaitables
+  template <typename Initiation, typename... InitArgs>
+  static return_type initiate(Initiation initiation, UseResult /*token*/,
+                              InitArgs... args) {
+    using Token =
+        boost::asio::redirect_error_t<boost::asio::use_awaitable_t<>>;
+    boost::system::error_code ec;
+    auto token = boost::asio::redirect_error(boost::asio::use_awaitable, ec);
+    if constexpr (sizeof...(Args) == 0) {
+      co_await boost::asio::async_initiate<Token,
+                                           void(boost::system::error_code)>(
+          std::move(initiation), token, std::move(args)...);
+      if (ec) {
+        co_return asio_failure<void>(ec);
+      }
+      co_return OUTCOME_V2_NAMESPACE::success();
+    } else {
+      auto value = co_await boost::asio::async_initiate<
+          Token, void(boost::system::error_code, Args...)>(
+          std::move(initiation), token, std::move(args)...);
+      if (ec) {
+        co_return asio_failure<typename result_type::value_type>(ec);
+      }
+      co_return result_type(std::move(value));
+    }
+  }
+};
@@ -0,0 +1,101 @@
+#include "asio-result.hh"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <gtest/gtest.h>
+
+#include <array>
+#include <chrono>
+#include <string_view>
+
+namespace asio = boost::asio;
+using asio::local::stream_protocol;
+
+namespace {
+
+using AsioCode =
+    SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_code<AsioErrc>;
+using GenericCode =
+    SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_code<GenericErrc>;
+
+/// run `f` as a coroutine on a fresh io_context until it finishes, the
+/// coroutines check with EXPECT as ASSERT can't return from them
+template <typename F>
+void run(F &&f) {
+  asio::io_context ctx;
+  bool done = false;
+  asio::co_spawn(
+      ctx,
+      [&]() -> asio::awaitable<void> {
+        co_await f(ctx);
+        done = true;
+      },
+      asio::detached);
+  ctx.run();
+  ASSERT_TRUE(done);
+}
+
+/// read exactly `n` bytes, the caller propagates any failure
+asio::awaitable<Result<std::string>> read_n(stream_protocol::socket &s,
+                                            size_t n) {
+  std::string out(n, '\0');
+  CO_TRY(auto n_read, co_await asio::async_read(s, asio::buffer(out),
+                                                use_result));
+  out.resize(n_read);
+  co_return out;
+}
+
+}  // namespace
+
+TEST(asio_result, read_write) {
+  run([](asio::io_context &ctx) -> asio::awaitable<void> {
+    stream_protocol::socket a(ctx);
+    stream_protocol::socket b(ctx);
+    asio::local::connect_pair(a, b);
+
+    auto written = co_await asio::async_write(
+        a, asio::buffer(std::string_view("hello")), use_result);
+    EXPECT_EQ(written.value(), 5);
+    auto read = co_await read_n(b, 5);
+    EXPECT_EQ(read.value(), "hello");
+
+    // eof arrives as a failure instead of an exception
+    a.close();
+    std::array<char, 16> buf{};
+    auto more = co_await b.async_read_some(asio::buffer(buf), use_result);
+    EXPECT_TRUE(more.has_failure());
+    if (more.has_failure()) {
+      EXPECT_EQ(more.error(), AsioCode(AsioErrc::eof));
+    }
+
+    auto again = co_await read_n(b, 1);
+    EXPECT_TRUE(again.has_failure());
+    if (again.has_failure()) {
+      EXPECT_EQ(again.error(), AsioCode(AsioErrc::eof));
+    }
+  });
+}
+
+TEST(asio_result, cancel) {
+  run([](asio::io_context &ctx) -> asio::awaitable<void> {
+    asio::steady_timer timer(ctx, std::chrono::hours(1));
+    asio::steady_timer canceller(ctx, std::chrono::milliseconds(1));
+    canceller.async_wait([&](auto) { timer.cancel(); });
+
+    auto waited = co_await timer.async_wait(use_result);
+    EXPECT_TRUE(waited.has_failure());
+    if (waited.has_failure()) {
+      EXPECT_EQ(waited.error(), GenericCode(GenericErrc::operation_canceled));
+    }
+
+    timer.expires_after(std::chrono::milliseconds(1));
+    auto expired = co_await timer.async_wait(use_result);
+    EXPECT_TRUE(expired.has_value());
+  });
+}
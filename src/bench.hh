@@ -0,0 +1,147 @@
+#pragma once
+
+// Scaffolding shared by the benchmarks: timing, allocation counting and the
+// JSON records they print. It replaces the global operator new and delete,
+// so include it from the one translation unit of a benchmark only.
+
+#include <fmt/format.h>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+
+namespace bench {
+
+inline std::atomic<bool> counting{false};
+inline std::atomic<int64_t> allocated_bytes{0};
+inline std::atomic<uint64_t> allocations{0};
+
+inline int64_t usable_size(void *p) {
+#if defined(__APPLE__)
+  return static_cast<int64_t>(malloc_size(p));
+#else
+  return static_cast<int64_t>(malloc_usable_size(p));
+#endif
+}
+
+/// Counts what goes through the global operator new while it is alive: the
+/// usable bytes allocated and not freed, and the number of allocations.
+/// Nothing is counted outside of one, so run the timed loops without it.
+/// Memory the runtime takes from malloc directly, like the objects of thrown
+/// exceptions, is not seen.
+class AllocationCounter {
+public:
+  AllocationCounter()
+      : bytes_before_(allocated_bytes.load()),
+        allocations_before_(bench::allocations.load()) {
+    counting = true;
+  }
+
+  AllocationCounter(const AllocationCounter &) = delete;
+  AllocationCounter &operator=(const AllocationCounter &) = delete;
+
+  ~AllocationCounter() {
+    counting = false;
+  }
+
+  int64_t bytes() const {
+    return allocated_bytes.load() - bytes_before_;
+  }
+
+  uint64_t allocations() const {
+    return bench::allocations.load() - allocations_before_;
+  }
+
+private:
+  int64_t bytes_before_;
+  uint64_t allocations_before_;
+};
+
+/// Prints a JSON array of one record per measurement, the labels of the
+/// measured case first:
+///
+///   reporter.report(R"("container": "rbtree")", "insert", 150.2, "ns/op");
+class Reporter {
+public:
+  explicit Reporter(std::FILE *out) : out_(out) {
+    fmt::print(out_, "[");
+  }
+
+  Reporter(const Reporter &) = delete;
+  Reporter &operator=(const Reporter &) = delete;
+
+  ~Reporter() {
+    fmt::print(out_, "\n]\n");
+  }
+
+  /// `labels` are JSON fields, without the braces
+  void report(std::string_view labels, std::string_view metric, double value,
+              std::string_view unit) {
+    fmt::print(out_,
+               "{}\n  {{{}, \"metric\": \"{}\", \"value\": {:.2f}, "
+               "\"unit\": \"{}\"}}",
+               first_ ? "" : ",", labels, metric, value, unit);
+    std::fflush(out_);
+    first_ = false;
+  }
+
+private:
+  std::FILE *out_;
+  bool first_ = true;
+};
+
+/// run `f` and return the nanoseconds per operation
+template <typename F>
+double time_per_op(uint64_t ops, F &&f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return static_cast<double>(
+             std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                 .count()) /
+         static_cast<double>(std::max<uint64_t>(ops, 1));
+}
+
+// keeps the optimizer from dropping the measured loops
+inline std::atomic<uint64_t> sink{0};
+
+}  // namespace bench
+
+// NOLINTBEGIN(cppcoreguidelines-no-malloc,cppcoreguidelines-owning-memory)
+
+void *operator new(size_t size) {
+  auto *p = malloc(std::max<size_t>(size, 1));
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  if (bench::counting.load(std::memory_order_relaxed)) {
+    bench::allocated_bytes.fetch_add(bench::usable_size(p),
+                                     std::memory_order_relaxed);
+    bench::allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return p;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr && bench::counting.load(std::memory_order_relaxed)) {
+    bench::allocated_bytes.fetch_sub(bench::usable_size(ptr),
+                                     std::memory_order_relaxed);
+  }
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t /*size*/) noexcept {
+  operator delete(ptr);
+}
+
+// NOLINTEND(cppcoreguidelines-no-malloc,cppcoreguidelines-owning-memory)
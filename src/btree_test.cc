@@ -0,0 +1,112 @@
+#include "persistent-btree.hh"
+
+#include <gtest/gtest.h>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+
+using Map = std::map<uint64_t, uint64_t>;
+
+void expect_content(const BTree &tree, const Map &expected) {
+  ASSERT_TRUE(tree.is_valid());
+  ASSERT_EQ(tree.size(), expected.size());
+  for (auto [key, value] : expected) {
+    ASSERT_EQ(tree.get(key), value) << key;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  tree.for_each([&](uint64_t key, uint64_t value) {
+    entries.emplace_back(key, value);
+  });
+  ASSERT_EQ(entries, decltype(entries)(expected.begin(), expected.end()));
+}
+
+}  // namespace
+
+TEST(BTree, insert_remove) {
+  BTree tree;
+  Map expected;
+  std::mt19937_64 rng(42);
+
+  for (int i = 0; i < 20000; i++) {
+    auto key = rng() % 2048;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(tree.remove(key), expected.erase(key) == 1);
+    } else {
+      tree.insert(key, i);
+      expected[key] = i;
+    }
+    ASSERT_TRUE(tree.is_valid()) << i;
+    ASSERT_EQ(tree.size(), expected.size());
+  }
+  expect_content(tree, expected);
+  for (uint64_t key = 0; key < 2048; key++) {
+    EXPECT_EQ(tree.get(key).has_value(), expected.contains(key)) << key;
+  }
+
+  // drain the tree in order, then in reverse
+  auto drain = tree;
+  for (auto [key, _] : expected) {
+    ASSERT_TRUE(drain.remove(key));
+    ASSERT_TRUE(drain.is_valid());
+  }
+  EXPECT_TRUE(drain.empty());
+  drain = tree;
+  for (auto it = expected.rbegin(); it != expected.rend(); ++it) {
+    ASSERT_TRUE(drain.remove(it->first));
+    ASSERT_TRUE(drain.is_valid());
+  }
+  EXPECT_TRUE(drain.empty());
+  EXPECT_FALSE(drain.remove(0));
+}
+
+TEST(BTree, extreme_keys) {
+  BTree tree;
+  Map expected;
+  constexpr auto kMax = std::numeric_limits<uint64_t>::max();
+  for (uint64_t i = 0; i < 100; i++) {
+    tree.insert(kMax - i, i);
+    tree.insert(i, i);
+    expected[kMax - i] = i;
+    expected[i] = i;
+  }
+  expect_content(tree, expected);
+  EXPECT_FALSE(tree.get(1000).has_value());
+  EXPECT_TRUE(tree.remove(kMax));
+  expected.erase(kMax);
+  expect_content(tree, expected);
+}
+
+TEST(BTree, snapshot) {
+  BTree tree;
+  Map expected;
+  std::mt19937_64 rng(7);
+  std::vector<std::pair<BTree, Map>> versions;
+
+  for (int i = 0; i < 3000; i++) {
+    auto key = rng() % 512;
+    if (rng() % 2 == 0) {
+      tree.remove(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key, rng());
+      expected[key] = tree.get(key).value();
+    }
+    if (i % 100 == 0) {
+      versions.emplace_back(tree, expected);
+    }
+  }
+  for (auto &[version, map] : versions) {
+    expect_content(version, map);
+  }
+
+  // a moved-from tree is empty, not a count without a root
+  auto moved = std::move(tree);
+  expect_content(moved, expected);
+  expect_content(tree, {});  // NOLINT(bugprone-use-after-move)
+  tree = std::move(moved);
+  expect_content(tree, expected);
+  expect_content(moved, {});  // NOLINT(bugprone-use-after-move)
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <source_location>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/**
+ * Counters of the errors made per (domain, value), and a ring of the most
+ * recent ones, cheap enough to stay enabled in production. make_error
+ * records into ErrorStats::global().
+ *
+ * A (domain, value) key is claimed once in an open addressed table, after
+ * which recording it only writes to the shard of the calling thread: a
+ * relaxed counter and the shard's own ring of recent errors, so threads
+ * failing at once don't share a cache line. Each ring entry is a seqlock: a
+ * writer claims it with a CAS, which only the threads sharing the shard
+ * contend on, and a snapshot keeps only the entries which didn't change while
+ * read, and merges the rings by the time of the errors. Nothing blocks and
+ * nothing allocates; when the key table is full, or the key may be in a slot
+ * another thread is still claiming, the error is only counted as untracked.
+ */
+class ErrorStats {
+public:
+  static constexpr size_t kSlots = 256;
+  static constexpr size_t kShards = 16;
+  static constexpr size_t kRecent = 128;  // per shard, and in a snapshot
+
+  struct Counter {
+    uint64_t domain;
+    const char *domain_name;
+    int64_t value;
+    uint64_t count;
+  };
+
+  struct Event {
+    uint64_t time_ns;  // steady clock
+    uint32_t shard;
+    uint64_t seq;  // in the shard
+    uint64_t domain;
+    const char *domain_name;
+    int64_t value;
+    const char *file;
+    const char *function;
+    uint32_t line;
+  };
+
+  struct Snapshot {
+    std::vector<Counter> counters;  // by key slot
+    std::vector<Event> recent;      // by time, oldest first
+    uint64_t untracked = 0;
+
+    std::string to_json() const;
+  };
+
+  constexpr ErrorStats() = default;
+  ErrorStats(const ErrorStats &) = delete;
+  ErrorStats &operator=(const ErrorStats &) = delete;
+
+  static ErrorStats &global();
+
+  /// `domain_name` must be a string with static storage
+  void record(uint64_t domain, const char *domain_name, int64_t value,
+              const std::source_location &loc) noexcept {
+    if (!enabled_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto slot = find_or_claim(domain, domain_name, value);
+    auto &shard = shards_[shard_index()];
+    if (slot < kSlots) {
+      shard.counts[slot].fetch_add(1, std::memory_order_relaxed);
+    } else {
+      shard.untracked.fetch_add(1, std::memory_order_relaxed);
+    }
+    push_recent(shard, domain, domain_name, value, loc);
+  }
+
+  void set_enabled(bool enabled) noexcept {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const;
+
+private:
+  enum : uint32_t { kEmpty, kClaiming, kReady };
+
+  struct Key {
+    std::atomic<uint32_t> state{kEmpty};
+    uint64_t domain = 0;
+    const char *domain_name = nullptr;
+    int64_t value = 0;
+  };
+
+  // the fields are atomics only so that a reader racing a writer is
+  // well defined, seq decides whether what it read is kept
+  struct Entry {
+    std::atomic<uint64_t> seq{0};  // 2 * ticket + 1 while written, + 2 after
+    std::atomic<uint64_t> time_ns{0};
+    std::atomic<uint64_t> domain{0};
+    std::atomic<const char *> domain_name{nullptr};
+    std::atomic<int64_t> value{0};
+    std::atomic<const char *> file{nullptr};
+    std::atomic<const char *> function{nullptr};
+    std::atomic<uint32_t> line{0};
+  };
+
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, kSlots> counts{};
+    std::atomic<uint64_t> untracked{0};
+    std::atomic<uint64_t> head{0};
+    std::array<Entry, kRecent> recent{};
+  };
+
+  /// append `s` as a quoted JSON string, names and paths are UTF-8 already
+  static void json_string(fmt::memory_buffer &out, const char *s);
+
+  static size_t shard_index() noexcept {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return index;
+  }
+
+  static size_t hash(uint64_t domain, int64_t value) noexcept {
+    uint64_t x = domain ^ (static_cast<uint64_t>(value) * 0x9e3779b97f4a7c15);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 33;
+    return static_cast<size_t>(x);
+  }
+
+  /// the slot of the key, or kSlots when the table is full or the key may
+  /// be the one another thread is claiming right now
+  size_t find_or_claim(uint64_t domain, const char *domain_name,
+                       int64_t value) noexcept {
+    auto start = hash(domain, value);
+    bool passed_claim = false;
+    for (size_t i = 0; i < kSlots; i++) {
+      auto slot = (start + i) % kSlots;
+      auto &key = keys_[slot];
+      auto state = key.state.load(std::memory_order_acquire);
+      if (state == kEmpty) {
+        // claiming past a slot being claimed could track the key twice
+        if (passed_claim) {
+          return kSlots;
+        }
+        if (key.state.compare_exchange_strong(state, kClaiming,
+                                              std::memory_order_acquire)) {
+          key.domain = domain;
+          key.domain_name = domain_name;
+          key.value = value;
+          key.state.store(kReady, std::memory_order_release);
+          return slot;
+        }
+        // lost the slot, `state` is the winner's now
+      }
+      // the claiming thread may be preempted, look further rather than wait
+      if (state == kClaiming) {
+        passed_claim = true;
+        continue;
+      }
+      if (key.domain == domain && key.value == value) {
+        return slot;
+      }
+    }
+    return kSlots;
+  }
+
+  static void push_recent(Shard &shard, uint64_t domain,
+                          const char *domain_name, int64_t value,
+                          const std::source_location &loc) noexcept {
+    constexpr auto relaxed = std::memory_order_relaxed;
+    auto time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+    auto ticket = shard.head.fetch_add(1, relaxed);
+    auto &entry = shard.recent[ticket % kRecent];
+    // skip the entry rather than wait when a writer a lap behind or ahead
+    // still owns it, the ring is a sample and not a log
+    auto seq = entry.seq.load(relaxed);
+    if ((seq & 1) != 0 || seq > 2 * ticket ||
+        !entry.seq.compare_exchange_strong(seq, 2 * ticket + 1, relaxed)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.time_ns.store(static_cast<uint64_t>(time_ns), relaxed);
+    entry.domain.store(domain, relaxed);
+    entry.domain_name.store(domain_name, relaxed);
+    entry.value.store(value, relaxed);
+    entry.file.store(loc.file_name(), relaxed);
+    entry.function.store(loc.function_name(), relaxed);
+    entry.line.store(loc.line(), relaxed);
+    entry.seq.store(2 * ticket + 2, std::memory_order_release);
+  }
+
+  std::atomic<bool> enabled_{true};
+  std::array<Key, kSlots> keys_{};
+  std::array<Shard, kShards> shards_{};
+};
+
+inline ErrorStats &ErrorStats::global() {
+  static constinit ErrorStats stats;
+  return stats;
+}
+
+inline ErrorStats::Snapshot ErrorStats::snapshot() const {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  Snapshot s;
+  for (size_t slot = 0; slot < kSlots; slot++) {
+    const auto &key = keys_[slot];
+    if (key.state.load(std::memory_order_acquire) != kReady) {
+      continue;
+    }
+    uint64_t count = 0;
+    for (const auto &shard : shards_) {
+      count += shard.counts[slot].load(relaxed);
+    }
+    s.counters.push_back({key.domain, key.domain_name, key.value, count});
+  }
+  for (const auto &shard : shards_) {
+    s.untracked += shard.untracked.load(relaxed);
+  }
+
+  for (uint32_t index = 0; index < kShards; index++) {
+    const auto &shard = shards_[index];
+    auto head = shard.head.load(std::memory_order_acquire);
+    auto first = head > kRecent ? head - kRecent : 0;
+    for (auto ticket = first; ticket < head; ticket++) {
+      const auto &entry = shard.recent[ticket % kRecent];
+      auto seq = entry.seq.load(std::memory_order_acquire);
+      if (seq != 2 * ticket + 2) {
+        continue;
+      }
+      Event e{entry.time_ns.load(relaxed),
+              index,
+              ticket,
+              entry.domain.load(relaxed),
+              entry.domain_name.load(relaxed),
+              entry.value.load(relaxed),
+              entry.file.load(relaxed),
+              entry.function.load(relaxed),
+              entry.line.load(relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (entry.seq.load(relaxed) == seq) {
+        s.recent.push_back(e);
+      }
+    }
+  }
+
+  // every shard kept its last kRecent, so the last kRecent of all are there
+  std::sort(s.recent.begin(), s.recent.end(),
+            [](const Event &a, const Event &b) {
+              return std::tie(a.time_ns, a.shard, a.seq) <
+                     std::tie(b.time_ns, b.shard, b.seq);
+            });
+  if (s.recent.size() > kRecent) {
+    s.recent.erase(s.recent.begin(), s.recent.end() - kRecent);
+  }
+  return s;
+}
+
+inline std::string ErrorStats::Snapshot::to_json() const {
+  fmt::memory_buffer out;
+  auto it = std::back_inserter(out);
+  fmt::format_to(it, "{{\"counters\": [");
+  for (size_t i = 0; i < counters.size(); i++) {
+    const auto &c = counters[i];
+    fmt::format_to(it, "{}{{\"domain\": \"{:016x}\", \"name\": ",
+                   i == 0 ? "" : ", ", c.domain);
+    json_string(out, c.domain_name);
+    fmt::format_to(it, ", \"value\": {}, \"count\": {}}}", c.value,
+                   c.count);
+  }
+  fmt::format_to(it, "], \"untracked\": {}, \"recent\": [", untracked);
+  for (size_t i = 0; i < recent.size(); i++) {
+    const auto &e = recent[i];
+    fmt::format_to(it,
+                   "{}{{\"time_ns\": {}, \"shard\": {}, \"seq\": {}, "
+                   "\"domain\": \"{:016x}\", \"name\": ",
+                   i == 0 ? "" : ", ", e.time_ns, e.shard, e.seq, e.domain);
+    json_string(out, e.domain_name);
+    fmt::format_to(it, ", \"value\": {}, \"file\": ", e.value);
+    json_string(out, e.file);
+    fmt::format_to(it, ", \"line\": {}, \"function\": ", e.line);
+    json_string(out, e.function);
+    fmt::format_to(it, "}}");
+  }
+  fmt::format_to(it, "]}}");
+  return fmt::to_string(out);
+}
+
+inline void ErrorStats::json_string(fmt::memory_buffer &out, const char *s) {
+  auto it = std::back_inserter(out);
+  out.push_back('"');
+  for (; s && *s; s++) {
+    auto c = static_cast<unsigned char>(*s);
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(static_cast<char>(c));
+    } else if (c < 0x20) {
+      fmt::format_to(it, "\\u{:04x}", c);
+    } else {
+      out.push_back(static_cast<char>(c));
+    }
+  }
+  out.push_back('"');
+}
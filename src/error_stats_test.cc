@@ -0,0 +1,221 @@
+#include "error-stats.hh"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "outcome.hh"
+
+namespace {
+
+enum class StatsErrc { first = 1, second = 7 };
+
+using Counts = std::map<std::pair<uint64_t, int64_t>, uint64_t>;
+
+Counts counts(const ErrorStats::Snapshot &s) {
+  Counts result;
+  for (const auto &c : s.counters) {
+    result[{c.domain, c.value}] += c.count;
+  }
+  return result;
+}
+
+}  // namespace
+
+QUICK_STATUS_CODE(StatsErrc, first, second)
+
+TEST(ErrorStats, counters) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  constexpr int kThreads = 8;
+  constexpr int kErrors = 10000;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kErrors; i++) {
+        stats->record(t % 2, "domain", i % 3, loc);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // an error racing the claim of its key is only counted as untracked
+  auto s = stats->snapshot();
+  EXPECT_EQ(s.counters.size(), 6);
+  auto c = counts(s);
+  ASSERT_EQ(c.size(), 6);
+  uint64_t total = s.untracked;
+  for (auto [key, count] : c) {
+    total += count;
+  }
+  EXPECT_EQ(total, kThreads * kErrors);
+  EXPECT_LE((c[{0, 0}]), kThreads / 2 * 3334);
+  EXPECT_LE((c[{1, 2}]), kThreads / 2 * 3333);
+}
+
+TEST(ErrorStats, concurrent_claims) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  constexpr int kThreads = 8;
+  constexpr int kKeys = 200;
+
+  std::atomic<int> ready{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&] {
+      ready++;
+      while (ready.load() < kThreads) {
+      }
+      for (int i = 0; i < kKeys; i++) {
+        stats->record(i % 5, "domain", i, loc);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // every key claimed once, every error either counted or untracked
+  auto s = stats->snapshot();
+  EXPECT_EQ(s.counters.size(), kKeys);
+  EXPECT_EQ(counts(s).size(), kKeys);
+  uint64_t total = s.untracked;
+  for (const auto &c : s.counters) {
+    total += c.count;
+  }
+  EXPECT_EQ(total, kThreads * kKeys);
+}
+
+TEST(ErrorStats, full_table) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  for (size_t i = 0; i < ErrorStats::kSlots + 10; i++) {
+    stats->record(42, "domain", static_cast<int64_t>(i), loc);
+  }
+  stats->record(42, "domain", 0, loc);
+  auto s = stats->snapshot();
+  EXPECT_EQ(s.counters.size(), ErrorStats::kSlots);
+  EXPECT_EQ(s.untracked, 10);
+  EXPECT_EQ((counts(s)[{42, 0}]), 2);
+}
+
+TEST(ErrorStats, recent) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  for (int i = 0; i < 10; i++) {
+    stats->record(1, "domain", i, loc);
+  }
+  auto s = stats->snapshot();
+  ASSERT_EQ(s.recent.size(), 10);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(s.recent[i].seq, i);
+    EXPECT_EQ(s.recent[i].value, i);
+    EXPECT_EQ(s.recent[i].line, loc.line());
+    EXPECT_STREQ(s.recent[i].file, loc.file_name());
+  }
+
+  // only the last kRecent survive
+  for (size_t i = 10; i < 3 * ErrorStats::kRecent; i++) {
+    stats->record(1, "domain", static_cast<int64_t>(i), loc);
+  }
+  s = stats->snapshot();
+  ASSERT_EQ(s.recent.size(), ErrorStats::kRecent);
+  EXPECT_EQ(s.recent.front().value, 2 * ErrorStats::kRecent);
+  EXPECT_EQ(s.recent.back().value, 3 * ErrorStats::kRecent - 1);
+
+  stats->set_enabled(false);
+  stats->record(1, "domain", 0, loc);
+  s = stats->snapshot();
+  EXPECT_EQ(s.recent.back().seq, 3 * ErrorStats::kRecent - 1);
+}
+
+TEST(ErrorStats, concurrent_snapshot) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      while (!stop.load()) {
+        stats->record(t, "domain", t, loc);
+      }
+    });
+  }
+  for (int i = 0; i < 200; i++) {
+    auto s = stats->snapshot();
+    for (size_t j = 0; j < s.recent.size(); j++) {
+      // an event is never torn between two writers
+      ASSERT_EQ(s.recent[j].domain, s.recent[j].value);
+      ASSERT_TRUE(j == 0 || s.recent[j - 1].time_ns <= s.recent[j].time_ns);
+    }
+  }
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+TEST(ErrorStats, merged_shards) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  // threads after another record into different shards
+  for (int t = 0; t < 3; t++) {
+    std::thread([&, t] {
+      for (int i = 0; i < 10; i++) {
+        stats->record(1, "domain", t * 10 + i, loc);
+      }
+    }).join();
+  }
+  auto s = stats->snapshot();
+  ASSERT_EQ(s.recent.size(), 30);
+  for (int i = 0; i < 30; i++) {
+    EXPECT_EQ(s.recent[i].value, i);
+  }
+  EXPECT_NE(s.recent.front().shard, s.recent.back().shard);
+}
+
+TEST(ErrorStats, json_escape) {
+  auto stats = std::make_unique<ErrorStats>();
+  auto loc = std::source_location::current();
+  stats->record(1, "a \"quoted\"\\name\n", 0, loc);
+  auto json = stats->snapshot().to_json();
+  EXPECT_NE(json.find(R"("name": "a \"quoted\"\\name\u000a")"),
+            std::string::npos)
+      << json;
+}
+
+TEST(ErrorStats, make_error) {
+  auto before = counts(ErrorStats::global().snapshot());
+  auto first = make_error(StatsErrc::first);
+  auto second = make_error(StatsErrc::second, "payload");
+  auto again = make_error(StatsErrc::second, 3);
+  auto anyhow = make_error("anyhow");
+  auto s = ErrorStats::global().snapshot();
+  auto after = counts(s);
+
+  using Domain =
+      SYSTEM_ERROR2_NAMESPACE::EnumPayloadDomainImpl<StatsErrc, void>;
+  auto anyhow_domain = anyhow.domain().id();
+  EXPECT_EQ((after[{Domain::payload_uuid, 1}]), 1);
+  EXPECT_EQ((after[{Domain::payload_uuid, 7}]), 2);
+  EXPECT_EQ((after[{anyhow_domain, 0}] - before[{anyhow_domain, 0}]), 1);
+
+  ASSERT_GE(s.recent.size(), 4);
+  const auto &last = s.recent.back();
+  EXPECT_STREQ(last.domain_name, "Anyhow");
+  const auto &enum_error = s.recent[s.recent.size() - 2];
+  EXPECT_STREQ(enum_error.domain_name, "StatsErrc");
+  EXPECT_EQ(enum_error.value, 7);
+  EXPECT_EQ(enum_error.line, again.value().loc.line());
+
+  auto json = s.to_json();
+  EXPECT_NE(json.find("\"name\": \"StatsErrc\", \"value\": 7, \"count\": 2"),
+            std::string::npos);
+}
@@ -0,0 +1,157 @@
+#include "persistent-hamt.hh"
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+
+using Map = std::map<uint64_t, uint64_t>;
+
+void expect_content(const HAMT &map, const Map &expected) {
+  ASSERT_TRUE(map.is_valid());
+  ASSERT_EQ(map.size(), expected.size());
+  for (auto [key, value] : expected) {
+    ASSERT_EQ(map.get(key), value) << key;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  map.for_each([&](uint64_t key, uint64_t value) {
+    entries.emplace_back(key, value);
+  });
+  std::sort(entries.begin(), entries.end());
+  ASSERT_EQ(entries, decltype(entries)(expected.begin(), expected.end()));
+}
+
+}  // namespace
+
+TEST(HAMT, insert_remove) {
+  HAMT map;
+  Map expected;
+  std::mt19937_64 rng(42);
+
+  for (int i = 0; i < 20000; i++) {
+    auto key = rng() % 2048;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(map.remove(key), expected.erase(key) == 1);
+    } else {
+      map.insert(key, i);
+      expected[key] = i;
+    }
+    ASSERT_TRUE(map.is_valid()) << i;
+    ASSERT_EQ(map.size(), expected.size());
+  }
+  expect_content(map, expected);
+  for (uint64_t key = 0; key < 2048; key++) {
+    EXPECT_EQ(map.contains(key), expected.contains(key)) << key;
+  }
+
+  auto drain = map;
+  for (auto [key, _] : expected) {
+    ASSERT_TRUE(drain.remove(key));
+    ASSERT_TRUE(drain.is_valid());
+  }
+  EXPECT_TRUE(drain.empty());
+  EXPECT_FALSE(drain.remove(0));
+  expect_content(map, expected);
+}
+
+TEST(HAMT, extreme_keys) {
+  HAMT map;
+  Map expected;
+  constexpr auto kMax = std::numeric_limits<uint64_t>::max();
+  for (uint64_t i = 0; i < 100; i++) {
+    map.insert(kMax - i, i);
+    map.insert(i, i);
+    expected[kMax - i] = i;
+    expected[i] = i;
+  }
+  expect_content(map, expected);
+  EXPECT_FALSE(map.get(1000).has_value());
+  EXPECT_TRUE(map.remove(kMax));
+  expected.erase(kMax);
+  expect_content(map, expected);
+}
+
+TEST(HAMT, snapshot) {
+  HAMT map;
+  Map expected;
+  std::mt19937_64 rng(7);
+  std::vector<std::pair<HAMT, Map>> versions;
+
+  for (int i = 0; i < 3000; i++) {
+    auto key = rng() % 512;
+    if (rng() % 2 == 0) {
+      map.remove(key);
+      expected.erase(key);
+    } else {
+      map.insert(key, rng());
+      expected[key] = map.get(key).value();
+    }
+    if (i % 100 == 0) {
+      versions.emplace_back(map, expected);
+    }
+  }
+  for (auto &[version, content] : versions) {
+    expect_content(version, content);
+  }
+
+  // a moved-from map is empty, not a count without a root
+  auto moved = std::move(map);
+  expect_content(moved, expected);
+  expect_content(map, {});  // NOLINT(bugprone-use-after-move)
+  map = std::move(moved);
+  expect_content(map, expected);
+  expect_content(moved, {});  // NOLINT(bugprone-use-after-move)
+}
+
+TEST(HAMT, transient) {
+  HAMT map;
+  Map expected;
+  for (uint64_t i = 0; i < 1000; i++) {
+    map.insert(i, i);
+    expected[i] = i;
+  }
+  auto before = expected;
+
+  std::mt19937_64 rng(3);
+  auto batch = map.transient();
+  for (int i = 0; i < 20000; i++) {
+    auto key = rng() % 4096;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(batch.remove(key), expected.erase(key) == 1);
+    } else {
+      batch.insert(key, i);
+      expected[key] = i;
+    }
+    ASSERT_EQ(batch.size(), expected.size());
+  }
+  auto updated = std::move(batch).persistent();
+  expect_content(updated, expected);
+  expect_content(map, before);
+
+  // a second batch must not update the nodes of the first in place
+  auto second = updated.transient();
+  for (auto [key, _] : expected) {
+    second.insert(key, 0);
+  }
+  auto zeroed = std::move(second).persistent();
+  expect_content(updated, expected);
+  for (auto &[_, value] : expected) {
+    value = 0;
+  }
+  expect_content(zeroed, expected);
+
+  // the shape only depends on the keys
+  HAMT rebuilt;
+  for (auto [key, value] : expected) {
+    rebuilt.insert(key, value);
+  }
+  std::vector<uint64_t> a;
+  std::vector<uint64_t> b;
+  zeroed.for_each([&](uint64_t key, uint64_t) { a.push_back(key); });
+  rebuilt.for_each([&](uint64_t key, uint64_t) { b.push_back(key); });
+  EXPECT_EQ(a, b);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <utility>
+
+/**
+ * Intrusive reference to a `T` holding its own `std::atomic<uint32_t> refs_`.
+ * A single word instead of the two words of std::shared_ptr, and the count
+ * lives in the object itself, so it needs no separate control block or
+ * enable_shared_from_this weak pointer. The last reference frees the object
+ * with `T::destroy(p)` if `T` has one, for objects not allocated by `new T`
+ * or whose dynamic type is a derived class without a virtual destructor, and
+ * with `delete` otherwise.
+ */
+template <typename T>
+class IntrusivePtr {
+public:
+  IntrusivePtr() = default;
+
+  IntrusivePtr(std::nullptr_t) {}  // NOLINT(google-explicit-constructor)
+
+  explicit IntrusivePtr(T *p) : p_(p) {
+    if (p_) {
+      p_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  IntrusivePtr(const IntrusivePtr &other) : IntrusivePtr(other.p_) {}
+
+  IntrusivePtr(IntrusivePtr &&other) noexcept
+      : p_(std::exchange(other.p_, nullptr)) {}
+
+  /// a reference to a derived `U` as one to its base `T`
+  template <typename U>
+    requires std::convertible_to<U *, T *>
+  IntrusivePtr(const IntrusivePtr<U> &other)  // NOLINT
+      : IntrusivePtr(static_cast<T *>(other.get())) {}
+
+  template <typename U>
+    requires std::convertible_to<U *, T *>
+  IntrusivePtr(IntrusivePtr<U> &&other) noexcept  // NOLINT
+      : p_(std::exchange(other.p_, nullptr)) {}
+
+  IntrusivePtr &operator=(const IntrusivePtr &other) {
+    IntrusivePtr(other).swap(*this);
+    return *this;
+  }
+
+  IntrusivePtr &operator=(IntrusivePtr &&other) noexcept {
+    IntrusivePtr(std::move(other)).swap(*this);
+    return *this;
+  }
+
+  ~IntrusivePtr() {
+    if (p_ && p_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      if constexpr (requires { T::destroy(p_); }) {
+        T::destroy(p_);
+      } else {
+        delete p_;
+      }
+    }
+  }
+
+  template <typename... Args>
+  static IntrusivePtr make(Args &&...args) {
+    return IntrusivePtr(new T(std::forward<Args>(args)...));
+  }
+
+  void swap(IntrusivePtr &other) noexcept {
+    std::swap(p_, other.p_);
+  }
+
+  T *get() const {
+    return p_;
+  }
+
+  T *operator->() const {
+    return p_;
+  }
+
+  T &operator*() const {
+    return *p_;
+  }
+
+  explicit operator bool() const {
+    return p_ != nullptr;
+  }
+
+  friend bool operator==(const IntrusivePtr &a, const IntrusivePtr &b) {
+    return a.p_ == b.p_;
+  }
+
+private:
+  template <typename U>
+  friend class IntrusivePtr;
+
+  T *p_ = nullptr;
+};
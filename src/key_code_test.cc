@@ -0,0 +1,76 @@
+#include "key-code.hh"
+
+#include <gtest/gtest.h>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+std::vector<uint32_t> parse(KeyCodeParser &parser, std::string_view input) {
+  std::vector<uint32_t> keys;
+  parser.parse(
+      std::span(reinterpret_cast<const uint8_t *>(input.data()), input.size()),
+      [&](KeyCode key) { keys.push_back(key.c); });
+  return keys;
+}
+
+std::vector<uint32_t> keys(std::initializer_list<KeyCode> codes) {
+  std::vector<uint32_t> result;
+  for (auto code : codes) {
+    result.push_back(code.c);
+  }
+  return result;
+}
+
+}  // namespace
+
+TEST(KeyCodeParser, split_sequence) {
+  KeyCodeParser parser(127);
+  // an incomplete sequence waits for the rest instead of spinning
+  EXPECT_TRUE(parse(parser, "\x1b[1;5").empty());
+  EXPECT_EQ(parse(parser, "A"), keys({ctrl(KeyCode::Up)}));
+
+  // byte by byte
+  std::vector<uint32_t> all;
+  for (char c : std::string_view("\x1b[1;3B\x1bOPx")) {
+    auto got = parse(parser, std::string_view(&c, 1));
+    all.insert(all.end(), got.begin(), got.end());
+  }
+  EXPECT_EQ(all, keys({alt(KeyCode::Down), KeyCode::F1, 'x'}));
+
+  EXPECT_TRUE(parse(parser, "\x1bO").empty());
+  EXPECT_EQ(parse(parser, "Q"), keys({KeyCode::F2}));
+}
+
+TEST(KeyCodeParser, long_parameter) {
+  KeyCodeParser parser(127);
+  // saturates instead of overflowing, and no key has that number
+  auto input = "\x1b[" + std::string(100, '9') + "~a";
+  EXPECT_EQ(parse(parser, input), keys({KeyCode::Invalid, 'a'}));
+  // 2^32 + 1 wrapped around would read as 1, Home
+  EXPECT_EQ(parse(parser, "\x1b[4294967297~"), keys({KeyCode::Invalid}));
+  input = "\x1b[1;" + std::string(50, '9') + "A";
+  auto got = parse(parser, input);
+  ASSERT_EQ(got.size(), 1);
+  EXPECT_EQ(got[0] & KeyCode::kCodepointMask, KeyCode::Up);
+}
+
+TEST(KeyCodeParser, longer_than_buffer) {
+  KeyCodeParser parser(127);
+  // a sequence which can't fit is dropped as invalid, the rest still parses
+  auto input = "\x1b[" + std::string(KeyCodeParser::Buffer::kCapacity, '1');
+  auto got = parse(parser, input);
+  ASSERT_FALSE(got.empty());
+  EXPECT_EQ(got.front(), KeyCode::Invalid);
+  EXPECT_LE(got.size(), KeyCodeParser::max_keys(input.size()));
+
+  parser.flush([](KeyCode) {});
+  EXPECT_EQ(parse(parser, "\x1b[A"), keys({KeyCode::Up}));
+
+  std::vector<KeyCode> out(KeyCodeParser::max_keys(input.size()), 0);
+  auto n = parser.parse(
+      std::span(reinterpret_cast<const uint8_t *>(input.data()), input.size()),
+      out);
+  EXPECT_GT(n, 0);
+  EXPECT_EQ(out[0].c, KeyCode::Invalid);
+}
@@ -1,17 +1,105 @@
 #pragma once
 
 #include <fmt/core.h>
+#include <fmt/format.h>
 #include <outcome.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
 #include <source_location>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "error-stats.hh"
 
 #define TRY(...) OUTCOME_TRY(__VA_ARGS__)
 #define TRYV(...) OUTCOME_TRYV(__VA_ARGS__)
 
+// TRY for coroutines, which propagate the failure with co_return
+#define CO_TRY(...) OUTCOME_CO_TRY(__VA_ARGS__)
+#define CO_TRYV(...) OUTCOME_CO_TRYV(__VA_ARGS__)
+
 #if defined(__GNUC__) || defined(__clang__)
 #define TRYX(...) OUTCOME_TRYX(__VA_ARGS__)
 #endif
 
+/**
+ * Specializes quick_status_code_from_enum for `Enum` from the list of its
+ * enumerators, at global namespace scope:
+ *
+ *   enum class MyErrc { Err1, Err2 };
+ *   QUICK_STATUS_CODE(MyErrc, Err1, Err2)
+ *
+ * The message of each value is its name. The domain and payload uuids are
+ * derived from the spelling of `Enum`, so they are stable across builds
+ * without being pasted by hand. QUICK_STATUS_CODE_GENERIC additionally maps
+ * every enumerator to the errc of the same name.
+ *
+ * The mappings are a constexpr array, which lets EnumValueBase find the
+ * mapping of a value through a constexpr index instead of a linear scan.
+ */
+#define QUICK_STATUS_CODE(Enum, ...)                                          \
+  QUICK_STATUS_CODE_SPECIALIZE(Enum, QUICK_STATUS_CODE_MAPPING, __VA_ARGS__)
+
+#define QUICK_STATUS_CODE_GENERIC(Enum, ...)                                  \
+  QUICK_STATUS_CODE_SPECIALIZE(Enum, QUICK_STATUS_CODE_GENERIC_MAPPING,       \
+                               __VA_ARGS__)
+
+#define QUICK_STATUS_CODE_SPECIALIZE(Enum, MAP, ...)                          \
+  SYSTEM_ERROR2_NAMESPACE_BEGIN                                               \
+  template <>                                                                 \
+  struct quick_status_code_from_enum<Enum>                                    \
+      : quick_status_code_from_enum_defaults<Enum> {                          \
+    static constexpr auto domain_name = #Enum;                                \
+    static constexpr auto domain_uuid_ =                                      \
+        detail::name_uuid(#Enum, "domain");                                   \
+    static constexpr auto payload_uuid_ =                                     \
+        detail::name_uuid(#Enum, "payload");                                  \
+    static constexpr const char *domain_uuid = domain_uuid_.data();           \
+    static constexpr const char *payload_uuid = payload_uuid_.data();         \
+    static constexpr bool all_failures = true;                                \
+    static constexpr mapping mappings_[] = {                                  \
+        QUICK_STATUS_CODE_FOR_EACH(MAP, Enum, __VA_ARGS__)};                  \
+    static constexpr std::span<const mapping> value_mappings() {             \
+      return mappings_;                                                       \
+    }                                                                         \
+  };                                                                          \
+  SYSTEM_ERROR2_NAMESPACE_END
+
+#define QUICK_STATUS_CODE_MAPPING(Enum, v) {Enum::v, #v, {}},
+#define QUICK_STATUS_CODE_GENERIC_MAPPING(Enum, v) {Enum::v, #v, {errc::v}},
+
+// applies `m(Enum, v)` to every enumerator `v`, for up to 256 of them
+#define QUICK_STATUS_CODE_FOR_EACH(m, Enum, ...)                              \
+  __VA_OPT__(QUICK_STATUS_CODE_EXPAND(                                        \
+      QUICK_STATUS_CODE_FOR_EACH_STEP(m, Enum, __VA_ARGS__)))
+#define QUICK_STATUS_CODE_FOR_EACH_STEP(m, Enum, v, ...)                      \
+  m(Enum, v) __VA_OPT__(                                                      \
+      QUICK_STATUS_CODE_FOR_EACH_AGAIN QUICK_STATUS_CODE_PARENS(              \
+          m, Enum, __VA_ARGS__))
+#define QUICK_STATUS_CODE_FOR_EACH_AGAIN() QUICK_STATUS_CODE_FOR_EACH_STEP
+#define QUICK_STATUS_CODE_PARENS ()
+#define QUICK_STATUS_CODE_EXPAND(...)                                         \
+  QUICK_STATUS_CODE_EXPAND3(QUICK_STATUS_CODE_EXPAND3(                        \
+      QUICK_STATUS_CODE_EXPAND3(QUICK_STATUS_CODE_EXPAND3(__VA_ARGS__))))
+#define QUICK_STATUS_CODE_EXPAND3(...)                                        \
+  QUICK_STATUS_CODE_EXPAND2(QUICK_STATUS_CODE_EXPAND2(                        \
+      QUICK_STATUS_CODE_EXPAND2(QUICK_STATUS_CODE_EXPAND2(__VA_ARGS__))))
+#define QUICK_STATUS_CODE_EXPAND2(...)                                        \
+  QUICK_STATUS_CODE_EXPAND1(QUICK_STATUS_CODE_EXPAND1(                        \
+      QUICK_STATUS_CODE_EXPAND1(QUICK_STATUS_CODE_EXPAND1(__VA_ARGS__))))
+#define QUICK_STATUS_CODE_EXPAND1(...) __VA_ARGS__
+
 namespace outcome = OUTCOME_V2_NAMESPACE::experimental;
 
 template <typename R,
@@ -78,25 +166,241 @@ using string_ref = status_code_domain::string_ref;
 using atomic_refcounted_string_ref =
     status_code_domain::atomic_refcounted_string_ref;
 
-inline string_ref to_string_ref(const std::string &s) {
-  auto p = (char *)malloc(s.size());   // NOLINT
-  std::memcpy(p, s.data(), s.size());  // NOLINT
-  return atomic_refcounted_string_ref{p, s.size()};
+constexpr uint64_t fnv1a(std::string_view s,
+                         uint64_t hash = 0xcbf29ce484222325) {
+  for (auto c : s) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/// a uuid string hashed from `name` and `salt`, which is stable across
+/// builds and platforms unlike the random uuids of quick_status_code.py
+constexpr std::array<char, 37> name_uuid(std::string_view name,
+                                         std::string_view salt) {
+  auto hi = fnv1a(salt, fnv1a("/", fnv1a(name)));
+  auto lo = fnv1a(name, hi);
+  std::array<char, 37> uuid{};
+  constexpr std::string_view kDigits = "0123456789abcdef";
+  for (size_t i = 0, digit = 0; i < 36; i++) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      uuid[i] = '-';
+      continue;
+    }
+    auto word = digit < 16 ? hi : lo;
+    uuid[i] = kDigits[(word >> (60 - 4 * (digit % 16))) & 0xf];
+    digit++;
+  }
+  return uuid;
 }
+
+/**
+ * A rendered message in a single allocation: the reference count, then the
+ * characters and a terminating NUL.
+ */
+class SharedMessage {
+public:
+  SharedMessage(const SharedMessage &) = delete;
+  SharedMessage &operator=(const SharedMessage &) = delete;
+
+  /// returns nullptr when out of memory, the caller owns one reference
+  static const SharedMessage *make(std::string_view s) noexcept {
+    auto *p = std::malloc(sizeof(SharedMessage) + s.size() + 1);  // NOLINT
+    if (!p) {
+      return nullptr;
+    }
+    auto *m = new (p) SharedMessage(s.size());
+    std::memcpy(m->data(), s.data(), s.size());
+    m->data()[s.size()] = '\0';
+    return m;
+  }
+
+  void retain() const noexcept {
+    refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void release() const noexcept {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      this->~SharedMessage();
+      std::free(const_cast<SharedMessage *>(this));  // NOLINT
+    }
+  }
+
+  const char *data() const noexcept {
+    return reinterpret_cast<const char *>(this + 1);
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+
+private:
+  explicit SharedMessage(size_t size) : size_(size) {}
+  ~SharedMessage() = default;
+
+  char *data() noexcept {
+    return reinterpret_cast<char *>(this + 1);
+  }
+
+  mutable std::atomic<uint32_t> refs_{1};
+  size_t size_;
+};
+
+/// a string_ref holding a reference to a SharedMessage in its first state
+/// slot, copies only touch the reference count
+class SharedMessageRef final : public string_ref {
+  static void thunk(string_ref *dest, const string_ref *src,
+                    _thunk_op op) noexcept {
+    auto *d = static_cast<SharedMessageRef *>(dest);  // NOLINT
+    switch (op) {
+    case _thunk_op::copy:
+      if (d->message()) {
+        d->message()->retain();
+      }
+      return;
+    case _thunk_op::move: {
+      auto *s = const_cast<string_ref *>(src);  // NOLINT
+      auto *from = static_cast<SharedMessageRef *>(s);  // NOLINT
+      from->_begin = from->_end = nullptr;
+      from->_state[0] = nullptr;
+      return;
+    }
+    case _thunk_op::destruct:
+      if (d->message()) {
+        d->message()->release();
+      }
+      return;
+    }
+  }
+
+  const SharedMessage *message() const noexcept {
+    return static_cast<const SharedMessage *>(_state[0]);
+  }
+
+public:
+  /// takes a new reference to `m`
+  explicit SharedMessageRef(const SharedMessage *m) noexcept
+      : string_ref(m->data(), m->size(),
+                   const_cast<SharedMessage *>(m),  // NOLINT
+                   nullptr, nullptr, thunk) {
+    m->retain();
+  }
+};
+
+/**
+ * The message of one error, rendered on the first message() call and shared
+ * by every later call and every copy of the error. A message therefore costs
+ * a single exactly sized allocation, and none after the first.
+ */
+class MessageCache {
+public:
+  MessageCache() = default;
+
+  MessageCache(const MessageCache &other) noexcept
+      : message_(other.message_.load(std::memory_order_acquire)) {
+    if (const auto *m = message_.load(std::memory_order_relaxed)) {
+      m->retain();
+    }
+  }
+
+  MessageCache(MessageCache &&other) noexcept
+      : message_(other.message_.exchange(nullptr, std::memory_order_relaxed)) {
+  }
+
+  MessageCache &operator=(const MessageCache &other) noexcept {
+    if (this != &other) {
+      MessageCache copy(other);
+      reset(copy.message_.exchange(nullptr, std::memory_order_relaxed));
+    }
+    return *this;
+  }
+
+  MessageCache &operator=(MessageCache &&other) noexcept {
+    if (this != &other) {
+      reset(other.message_.exchange(nullptr, std::memory_order_relaxed));
+    }
+    return *this;
+  }
+
+  ~MessageCache() {
+    reset(nullptr);
+  }
+
+  /// drop the rendered message, for values which change after rendering
+  void clear() noexcept {
+    reset(nullptr);
+  }
+
+  /// `render(fmt::memory_buffer &)` is called on a miss; concurrent misses
+  /// may both render, the first one to finish is kept
+  template <typename F>
+  string_ref get(F &&render) const noexcept {
+    if (const auto *m = message_.load(std::memory_order_acquire)) {
+      return SharedMessageRef(m);
+    }
+    fmt::memory_buffer buffer;
+    std::forward<F>(render)(buffer);
+    const auto *m = SharedMessage::make({buffer.data(), buffer.size()});
+    if (!m) {
+      return string_ref("failed to allocate the message");
+    }
+    const SharedMessage *expected = nullptr;
+    if (message_.compare_exchange_strong(expected, m,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+      // the cache keeps the reference returned by make()
+      return SharedMessageRef(m);
+    }
+    m->release();
+    return SharedMessageRef(expected);
+  }
+
+private:
+  void reset(const SharedMessage *m) noexcept {
+    if (const auto *old = message_.exchange(m, std::memory_order_acq_rel)) {
+      old->release();
+    }
+  }
+
+  mutable std::atomic<const SharedMessage *> message_{nullptr};
+};
 }  // namespace detail
 
+/**
+ * A domain which renders its messages into a caller supplied buffer, which
+ * its message() caches.
+ */
+class FormattingDomain : public status_code_domain {
+public:
+  virtual void _do_format_to(const status_code<void> &code,
+                             fmt::memory_buffer &out) const = 0;
+
+protected:
+  using status_code_domain::status_code_domain;
+};
+
+/// append the message of `code` to `out`, see the definition below
+inline void format_to(fmt::memory_buffer &out, const status_code<void> &code);
+
+/// the code make_nested_status_code() makes of an `E`, e.g. of an error with
+/// a payload or a ContextError held in a system_code
+template <typename E>
+using IndirectCode =
+    status_code<detail::indirecting_domain<E, std::allocator<E>>>;
+
 template <typename T>
 concept AnyhowValue =
     std::is_nothrow_move_constructible_v<T> && fmt::is_formattable<T>::value;
 
 template <typename T>
   requires AnyhowValue<T>
-struct AnyhowDomainImpl final : public status_code_domain {
-  using Base = status_code_domain;
+struct AnyhowDomainImpl final : public FormattingDomain {
+  using Base = FormattingDomain;
 
   struct value_type {
     T value;
     std::source_location location;
+    detail::MessageCache message{};
   };
 
   // 0xf1b0a9ec56db8239 ^ 0xc44f7bdeb2cc50e9 = 0x35ffd232e417d2d0
@@ -151,8 +455,17 @@ struct AnyhowDomainImpl final : public status_code_domain {
     assert(code.domain() == *this);
     using Self = status_code<AnyhowDomainImpl<T>>;
     const auto &value = static_cast<const Self &>(code).value();  // NOLINT
-    return detail::to_string_ref(
-        fmt::format("{} {}", value.location, value.value));
+    return value.message.get(
+        [&](fmt::memory_buffer &out) { _do_format_to(code, out); });
+  }
+
+  void _do_format_to(const status_code<void> &code,
+                     fmt::memory_buffer &out) const final {
+    assert(code.domain() == *this);
+    using Self = status_code<AnyhowDomainImpl<T>>;
+    const auto &value = static_cast<const Self &>(code).value();  // NOLINT
+    fmt::format_to(std::back_inserter(out), "{} {}", value.location,
+                   value.value);
   }
 
   void _do_throw_exception(const status_code<void> &code) const final {
@@ -202,6 +515,162 @@ struct EnumPayloadDomainImpl;
 template <typename Enum, typename Payload = void>
 using EnumPayloadError = status_code<EnumPayloadDomainImpl<Enum, Payload>>;
 
+/// the mappings are usable in constant expressions, as QUICK_STATUS_CODE
+/// defines them
+template <typename Enum>
+concept ConstexprQuickEnum = requires {
+  typename std::integral_constant<
+      size_t, quick_status_code_from_enum<Enum>::value_mappings().size()>;
+};
+
+/**
+ * Maps an enum value to the position of its first mapping in constant time,
+ * through a table spanning the range of the values. Sparse enums, whose
+ * table would be too large, are binary searched in a sorted copy instead.
+ *
+ * The errc equivalents of every mapping are kept as a bitset as well, so
+ * that comparing against a generic_code is a single bit test.
+ */
+template <typename Enum>
+  requires ConstexprQuickEnum<Enum>
+class QuickEnumIndex {
+  using QuickEnum = quick_status_code_from_enum<Enum>;
+  using Mapping = typename QuickEnum::mapping;
+
+  static constexpr auto kMappings = QuickEnum::value_mappings();
+  static constexpr size_t kCount = kMappings.size();
+  static_assert(kCount > 0 && kCount < UINT16_MAX);
+  static constexpr uint16_t kNone = UINT16_MAX;
+
+  static constexpr int64_t key(Enum v) {
+    return static_cast<int64_t>(v);
+  }
+
+  static constexpr auto kBounds = [] {
+    std::pair<int64_t, int64_t> bounds{key(kMappings[0].value),
+                                       key(kMappings[0].value)};
+    for (const auto &m : kMappings) {
+      bounds.first = std::min(bounds.first, key(m.value));
+      bounds.second = std::max(bounds.second, key(m.value));
+    }
+    return bounds;
+  }();
+  static constexpr auto kSpan =
+      static_cast<uint64_t>(kBounds.second - kBounds.first) + 1;
+  static constexpr bool kDense = kSpan <= 4 * kCount + 64;
+
+  static constexpr auto kTable = [] {
+    if constexpr (kDense) {
+      std::array<uint16_t, kSpan> table{};
+      table.fill(kNone);
+      for (size_t i = 0; i < kCount; i++) {
+        auto &slot = table[key(kMappings[i].value) - kBounds.first];
+        if (slot == kNone) {
+          slot = static_cast<uint16_t>(i);
+        }
+      }
+      return table;
+    } else {
+      // (key, position) sorted by key, the first mapping wins on ties
+      std::array<std::pair<int64_t, uint16_t>, kCount> sorted{};
+      for (size_t i = 0; i < kCount; i++) {
+        sorted[i] = {key(kMappings[i].value), static_cast<uint16_t>(i)};
+      }
+      std::sort(sorted.begin(), sorted.end());
+      return sorted;
+    }
+  }();
+
+  // errc e is bit e + 1, which covers unknown (-1) and every errno value
+  static constexpr int kErrcBits = 256;
+  using ErrcSet = std::array<uint64_t, kErrcBits / 64>;
+
+  static constexpr int errc_bit(errc e) {
+    return static_cast<int>(e) + 1;
+  }
+
+  static constexpr bool kErrcsFit = [] {
+    for (const auto &m : kMappings) {
+      for (auto e : m.code_mappings) {
+        if (errc_bit(e) < 0 || errc_bit(e) >= kErrcBits) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }();
+
+  static constexpr auto kErrcs = [] {
+    std::array<ErrcSet, kCount> sets{};
+    for (size_t i = 0; i < kCount; i++) {
+      for (auto e : kMappings[i].code_mappings) {
+        auto bit = errc_bit(e);
+        if (bit >= 0 && bit < kErrcBits) {
+          sets[i][bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+      }
+    }
+    return sets;
+  }();
+
+  static constexpr auto kGenericErrcs = [] {
+    std::array<errc, kCount> first{};
+    for (size_t i = 0; i < kCount; i++) {
+      first[i] = kMappings[i].code_mappings.size() > 0
+                     ? *kMappings[i].code_mappings.begin()
+                     : errc::unknown;
+    }
+    return first;
+  }();
+
+  /// position of the first mapping of `v`, or kNone
+  static constexpr uint16_t position(Enum v) {
+    auto k = key(v);
+    if (k < kBounds.first || k > kBounds.second) {
+      return kNone;
+    }
+    if constexpr (kDense) {
+      return kTable[k - kBounds.first];
+    } else {
+      auto it = std::lower_bound(kTable.begin(), kTable.end(),
+                                 std::pair<int64_t, uint16_t>{k, 0});
+      return it != kTable.end() && it->first == k ? it->second : kNone;
+    }
+  }
+
+public:
+  static constexpr const Mapping *find(Enum v) {
+    auto i = position(v);
+    return i == kNone ? nullptr : &kMappings[i];
+  }
+
+  /// whether the mapping of `v` lists `e` as an equivalent
+  static constexpr bool maps_to(Enum v, errc e) {
+    auto i = position(v);
+    if (i == kNone) {
+      return false;
+    }
+    if constexpr (!kErrcsFit) {
+      for (auto ec : kMappings[i].code_mappings) {
+        if (ec == e) {
+          return true;
+        }
+      }
+      return false;
+    } else {
+      auto bit = errc_bit(e);
+      return bit >= 0 && bit < kErrcBits &&
+             (kErrcs[i][bit / 64] >> (bit % 64) & 1) != 0;
+    }
+  }
+
+  /// the first errc equivalent of `v`, or errc::unknown
+  static constexpr errc generic_errc(Enum v) {
+    auto i = position(v);
+    return i == kNone ? errc::unknown : kGenericErrcs[i];
+  }
+};
+
 template <typename Enum>
   requires std::is_enum_v<Enum> && HasQuickEnum<Enum>::value
 struct EnumValueBase {
@@ -209,12 +678,44 @@ struct EnumValueBase {
   using QuickEnumMapping = typename QuickEnum::mapping;
 
   static const QuickEnumMapping *find_mapping(Enum v) {
-    for (const auto &i : QuickEnum::value_mappings()) {
-      if (i.value == v) {
-        return &i;
+    if constexpr (ConstexprQuickEnum<Enum>) {
+      return QuickEnumIndex<Enum>::find(v);
+    } else {
+      for (const auto &i : QuickEnum::value_mappings()) {
+        if (i.value == v) {
+          return &i;
+        }
       }
+      return nullptr;
+    }
+  }
+
+  static bool maps_to(Enum v, errc e) {
+    if constexpr (ConstexprQuickEnum<Enum>) {
+      return QuickEnumIndex<Enum>::maps_to(v, e);
+    } else {
+      const auto *mapping = find_mapping(v);
+      assert(mapping != nullptr);
+      for (auto ec : mapping->code_mappings) {
+        if (ec == e) {
+          return true;
+        }
+      }
+      return false;
+    }
+  }
+
+  static errc generic_errc(Enum v) {
+    if constexpr (ConstexprQuickEnum<Enum>) {
+      return QuickEnumIndex<Enum>::generic_errc(v);
+    } else {
+      const auto *mapping = find_mapping(v);
+      assert(mapping != nullptr);
+      if (mapping->code_mappings.size() > 0) {
+        return *mapping->code_mappings.begin();
+      }
+      return errc::unknown;
     }
-    return nullptr;
   }
 };
 
@@ -223,12 +724,13 @@ struct EnumValue : EnumValueBase<Enum> {
   struct value_type {
     Enum value{};
     std::source_location loc = std::source_location::current();
+    detail::MessageCache message{};
   };
 
-  static std::string to_string(const value_type &v) {
+  static void format_to(fmt::memory_buffer &out, const value_type &v) {
     auto m = EnumValueBase<Enum>::find_mapping(v.value);
     assert(m);
-    return fmt::format("{} {}", v.loc, m->message);
+    fmt::format_to(std::back_inserter(out), "{} {}", v.loc, m->message);
   }
 };
 
@@ -239,17 +741,20 @@ struct EnumValue<Enum, Payload> : EnumValueBase<Enum> {
     Enum value{};
     Payload payload{};
     std::source_location loc = std::source_location::current();
+    detail::MessageCache message{};
   };
-  static std::string to_string(const value_type &v) {
+
+  static void format_to(fmt::memory_buffer &out, const value_type &v) {
     auto m = EnumValueBase<Enum>::find_mapping(v.value);
     assert(m);
-    return fmt::format("{} {} {}", v.loc, m->message, v.payload);
+    fmt::format_to(std::back_inserter(out), "{} {} {}", v.loc, m->message,
+                   v.payload);
   }
 };
 
 template <typename Enum, typename Payload>
-struct EnumPayloadDomainImpl final : public status_code_domain {
-  using Base = status_code_domain;
+struct EnumPayloadDomainImpl final : public FormattingDomain {
+  using Base = FormattingDomain;
   using QuickEnum = quick_status_code_from_enum<Enum>;
   using EnumPayloadErrorSelf = EnumPayloadError<Enum, Payload>;
 
@@ -287,14 +792,7 @@ struct EnumPayloadDomainImpl final : public status_code_domain {
       return true;
     } else {
       const auto &c = static_cast<const EnumPayloadErrorSelf &>(code);
-      const auto *_mapping = EnumValueType::find_mapping(c.value().value);
-      assert(_mapping != nullptr);
-      for (auto ec : _mapping->code_mappings) {
-        if (ec == errc::success) {
-          return false;
-        }
-      }
-      return true;
+      return !EnumValueType::maps_to(c.value().value, errc::success);
     }
   }
 
@@ -312,9 +810,8 @@ struct EnumPayloadDomainImpl final : public status_code_domain {
 
     assert(code1_id == payload_uuid);
     if (code1_id == (code2_id ^ 0xc44f7bdeb2cc50e9)) {
-      using IndirectCode = status_code<detail::indirecting_domain<
-          EnumPayloadErrorSelf, std::allocator<EnumPayloadErrorSelf>>>;
-      const auto &c2 = static_cast<const IndirectCode &>(code2);
+      const auto &c2 =
+          static_cast<const IndirectCode<EnumPayloadErrorSelf> &>(code2);
       return c1.value().value == c2.value()->sc.value().value;
     }
 
@@ -326,13 +823,7 @@ struct EnumPayloadDomainImpl final : public status_code_domain {
 
     if (code2.domain() == generic_code_domain) {
       const auto &c2 = static_cast<const generic_code &>(code2);  // NOLINT
-      const auto *_mapping = EnumValueType::find_mapping(c1.value().value);
-      assert(_mapping != nullptr);
-      for (auto ec : _mapping->code_mappings) {
-        if (ec == c2.value()) {
-          return true;
-        }
-      }
+      return EnumValueType::maps_to(c1.value().value, c2.value());
     }
     return false;
   }
@@ -341,18 +832,22 @@ struct EnumPayloadDomainImpl final : public status_code_domain {
       const status_code<void> &code) const noexcept final {
     assert(code.domain() == *this);
     auto value = static_cast<const EnumPayloadErrorSelf &>(code).value().value;
-    const auto *_mapping = EnumValueType::find_mapping(value);
-    assert(_mapping != nullptr);
-    if (_mapping->code_mappings.size() > 0) {
-      return *_mapping->code_mappings.begin();
-    }
-    return errc::unknown;
+    return EnumValueType::generic_errc(value);
   }
 
   string_ref _do_message(const status_code<void> &code) const noexcept final {
     assert(code.domain() == *this);
     const auto &c = static_cast<const EnumPayloadErrorSelf &>(code);
-    return detail::to_string_ref(EnumValueType::to_string(c.value()));
+    return c.value().message.get([&](fmt::memory_buffer &out) {
+      EnumValueType::format_to(out, c.value());
+    });
+  }
+
+  void _do_format_to(const status_code<void> &code,
+                     fmt::memory_buffer &out) const final {
+    assert(code.domain() == *this);
+    const auto &c = static_cast<const EnumPayloadErrorSelf &>(code);
+    EnumValueType::format_to(out, c.value());
   }
 
   void _do_throw_exception(const status_code<void> &code) const final;
@@ -380,12 +875,26 @@ void EnumPayloadDomainImpl<Enum, Payload>::_do_throw_exception(
   throw status_error<EnumPayloadDomainImpl<Enum, Payload>>(c);
 }
 
-/// make_error factory functions
+/// make_error factory functions, which count every error they make in
+/// ErrorStats::global()
+
+namespace detail {
+
+template <typename Enum>
+void record_error(Enum e, const std::source_location &loc) {
+  ErrorStats::global().record(
+      EnumPayloadDomainImpl<Enum, void>::payload_uuid,
+      quick_status_code_from_enum<Enum>::domain_name,
+      static_cast<int64_t>(e), loc);
+}
+
+}  // namespace detail
 
 template <typename Enum>
   requires std::is_enum_v<Enum>
 EnumPayloadError<Enum> make_error(
     Enum e, std::source_location loc = std::source_location::current()) {
+  detail::record_error(e, loc);
   return EnumPayloadError<Enum>({e, loc});
 }
 
@@ -395,6 +904,7 @@ template <typename Enum, typename Payload>
 EnumPayloadError<Enum, std::string> make_error(
     Enum e, Payload &&payload,
     std::source_location loc = std::source_location::current()) {
+  detail::record_error(e, loc);
   return EnumPayloadError<Enum, std::string>(
       {e, std::string(std::forward<Payload>(payload)), loc});
 }
@@ -404,6 +914,7 @@ template <typename Enum, typename Payload>
 EnumPayloadError<Enum, Payload> make_error(
     Enum e, Payload &&payload,
     std::source_location loc = std::source_location::current()) {
+  detail::record_error(e, loc);
   return EnumPayloadError<Enum, Payload>(
       {e, std::forward<Payload>(payload), loc});
 }
@@ -415,6 +926,9 @@ inline auto make_error(
     -> std::conditional_t<std::convertible_to<T, std::string>,
                           status_code<AnyhowDomainImpl<std::string>>,
                           status_code<AnyhowDomainImpl<T>>> {
+  // anyhow errors have no value to tell them apart
+  ErrorStats::global().record(AnyhowDomainImpl<std::string>::get().id(),
+                              "Anyhow", 0, location);
   if constexpr (std::convertible_to<T, std::string>) {
     using StatusCode = status_code<AnyhowDomainImpl<std::string>>;
     return StatusCode({std::string(std::forward<T>(value)), location});
@@ -424,10 +938,237 @@ inline auto make_error(
   }
 }
 
+/**
+ * An error with the frames of context() attached: a static description and
+ * the location of each caller which added one. The frames live in an inline
+ * array in the payload, so only the first context() allocates, when the
+ * error is wrapped, and every later one appends in place. Nothing is
+ * formatted until message().
+ *
+ * An error deserialized from a peer also carries the file and line it was
+ * made at there, which a std::source_location can't hold.
+ *
+ * The error stays equivalent to the one it wraps.
+ */
+class ContextDomainImpl final : public FormattingDomain {
+public:
+  using Base = FormattingDomain;
+
+  static constexpr size_t kFrames = 8;
+
+  struct Frame {
+    const char *what;
+    std::source_location loc;
+  };
+
+  struct RemoteLocation {
+    std::string file;  // empty for a local error
+    uint32_t line = 0;
+  };
+
+  struct value_type {
+    system_code error;
+    std::array<Frame, kFrames> frames{};
+    uint32_t size = 0;
+    uint32_t elided = 0;  // frames past kFrames, the outermost ones
+    RemoteLocation remote{};
+    detail::MessageCache message{};
+
+    value_type(system_code e, Frame frame) : error(std::move(e)) {
+      push(frame);
+    }
+
+    value_type(system_code e, RemoteLocation r)
+        : error(std::move(e)), remote(std::move(r)) {}
+
+    value_type(const value_type &other)
+        : error(other.error.clone()),
+          frames(other.frames),
+          size(other.size),
+          elided(other.elided),
+          remote(other.remote),
+          message(other.message) {}
+
+    value_type(value_type &&) noexcept = default;
+    value_type &operator=(const value_type &) = delete;
+    value_type &operator=(value_type &&) noexcept = default;
+    ~value_type() = default;
+
+    void push(Frame frame) noexcept {
+      if (size < kFrames) {
+        frames[size++] = frame;
+      } else {
+        elided++;
+      }
+      message.clear();
+    }
+  };
+
+  static constexpr uint64_t kUuid = 0x8d3f1c2b5a7e9046;
+
+  constexpr ContextDomainImpl() : Base(kUuid) {}
+  ContextDomainImpl(const ContextDomainImpl &) = default;
+  ContextDomainImpl(ContextDomainImpl &&) = default;
+  ContextDomainImpl &operator=(const ContextDomainImpl &) = default;
+  ContextDomainImpl &operator=(ContextDomainImpl &&) = default;
+  ~ContextDomainImpl() = default;
+
+  string_ref name() const noexcept final {
+    return string_ref("Context");
+  }
+
+  payload_info_t payload_info() const noexcept final {
+    return {sizeof(value_type),
+            sizeof(status_code_domain *) + sizeof(value_type),
+            (alignof(value_type) > alignof(status_code_domain *))
+                ? alignof(value_type)
+                : alignof(status_code_domain *)};
+  }
+
+  static constexpr const ContextDomainImpl &get();
+
+  bool _do_failure(const status_code<void> &code) const noexcept final {
+    assert(code.domain() == *this);
+    return value(code).error.failure();
+  }
+
+  bool _do_equivalent(const status_code<void> &code1,
+                      const status_code<void> &code2) const noexcept final {
+    assert(code1.domain() == *this);
+    return value(code1).error.equivalent(code2);
+  }
+
+  generic_code _generic_code(
+      const status_code<void> &code) const noexcept final {
+    assert(code.domain() == *this);
+    return value(code).error.generic_code();
+  }
+
+  string_ref _do_message(const status_code<void> &code) const noexcept final {
+    assert(code.domain() == *this);
+    return value(code).message.get(
+        [&](fmt::memory_buffer &out) { _do_format_to(code, out); });
+  }
+
+  /// the outermost frame first, then the remote location and the wrapped
+  /// error
+  void _do_format_to(const status_code<void> &code,
+                     fmt::memory_buffer &out) const final {
+    assert(code.domain() == *this);
+    const auto &v = value(code);
+    auto it = std::back_inserter(out);
+    if (v.elided > 0) {
+      fmt::format_to(it, "({} more): ", v.elided);
+    }
+    for (auto i = v.size; i-- > 0;) {
+      fmt::format_to(it, "{} {}: ", v.frames[i].loc, v.frames[i].what);
+    }
+    if (!v.remote.file.empty()) {
+      fmt::format_to(it, "from {}:{}: ", v.remote.file, v.remote.line);
+    }
+    format_to(out, v.error);
+  }
+
+  void _do_throw_exception(const status_code<void> &code) const final {
+    assert(code.domain() == *this);
+    const auto &c = static_cast<const status_code<ContextDomainImpl> &>(
+        code);  // NOLINT
+    throw status_error<ContextDomainImpl>(c);
+  }
+
+private:
+  static const value_type &value(const status_code<void> &code) noexcept {
+    return static_cast<const status_code<ContextDomainImpl> &>(code)  // NOLINT
+        .value();
+  }
+};
+
+constexpr ContextDomainImpl ContextDomain = {};
+
+constexpr const ContextDomainImpl &ContextDomainImpl::get() {
+  return ContextDomain;
+}
+
+using ContextError = status_code<ContextDomainImpl>;
+
+inline system_code make_status_code(ContextError value) {
+  return make_nested_status_code(std::move(value));
+}
+
+/// whether `code` is a ContextError as make_status_code() puts it into a
+/// system_code. The build has no RTTI, so it is told by the id of the
+/// indirecting domain, which the domain derives from ContextDomainImpl::kUuid.
+inline bool is_nested_context(const status_code<void> &code) noexcept {
+  return !code.empty() &&
+         code.domain() == IndirectCode<ContextError>::domain_type::get();
+}
+
+/// append `frame` to `code` when it already is a ContextError, which
+/// make_nested_status_code() keeps behind an indirecting domain
+inline bool push_context(status_code<void> &code,
+                         ContextDomainImpl::Frame frame) noexcept {
+  if (!is_nested_context(code)) {
+    return false;
+  }
+  auto &c = static_cast<IndirectCode<ContextError> &>(code);  // NOLINT
+  c.value()->sc.value().push(frame);
+  return true;
+}
+
+/// Only a Context error, whose cached message every pushed frame drops, is
+/// rendered straight into `out`. For any other domain this is message()
+/// plus an append: an erased code can't be told to be a FormattingDomain
+/// without RTTI, and their message() renders once and caches anyway.
+inline void format_to(fmt::memory_buffer &out, const status_code<void> &code) {
+  if (code.empty()) {
+    return;
+  }
+  if (code.domain().id() == ContextDomainImpl::kUuid) {
+    ContextDomain._do_format_to(code, out);
+    return;
+  }
+  if (is_nested_context(code)) {
+    const auto &c =
+        static_cast<const IndirectCode<ContextError> &>(code);  // NOLINT
+    ContextDomain._do_format_to(c.value()->sc, out);
+    return;
+  }
+  auto message = code.message();
+  out.append(message.data(), message.data() + message.size());
+}
+
 SYSTEM_ERROR2_NAMESPACE_END
 
 using SYSTEM_ERROR2_NAMESPACE::make_error;
 
+/**
+ * Attach `what`, which must be a string with static storage, and the
+ * location of the caller to the failure of `r`:
+ *
+ *   TRY(auto header, context(read_header(file), "reading the header"));
+ *
+ * The message of the failure then reads outermost context first, e.g.
+ * "main.cc:10 loading config: config.cc:42 reading the header: <error>",
+ * while comparisons still see the original error. A successful `r` is
+ * returned untouched.
+ */
+template <typename R>
+Result<R> context(
+    Result<R> r, const char *what,
+    std::source_location loc = std::source_location::current()) {
+  if (!r.has_error()) {
+    return r;
+  }
+  using SYSTEM_ERROR2_NAMESPACE::ContextDomainImpl;
+  using SYSTEM_ERROR2_NAMESPACE::ContextError;
+  ContextDomainImpl::Frame frame{what, loc};
+  if (SYSTEM_ERROR2_NAMESPACE::push_context(r.assume_error(), frame)) {
+    return r;
+  }
+  return ContextError(SYSTEM_ERROR2_NAMESPACE::in_place,
+                      std::move(r).assume_error(), frame);
+}
+
 enum class GenericErrc : int {  // NOLINT
   unknown = -1,
   address_family_not_supported = EAFNOSUPPORT,
@@ -744,101 +1485,27 @@ inline GenericErrc errno_to_errc(int e) {  // NOLINT
   return GenericErrc::unknown;
 }
 
-SYSTEM_ERROR2_NAMESPACE_BEGIN
-template <>
-struct quick_status_code_from_enum<GenericErrc>
-    : quick_status_code_from_enum_defaults<GenericErrc> {
-  static constexpr auto domain_name = "GenericErrc";
-  // 0xbe3fa47c5bf771af
-  static constexpr auto domain_uuid = "60e74dc8-2bb0-4f19-9af0-327decfabcf2";
-  // 0x7413569d6f9952c0 ^ 0xc44f7bdeb2cc50e9 = 0xb05c2d43dd550229
-  static constexpr auto payload_uuid = "93d3f92b-a755-4c14-9ff6-60dd7e307d53";
-  static constexpr bool all_failures = true;
-  static const std::initializer_list<mapping> &value_mappings() {
-    // NOLINTBEGIN
-    // clang-format off
-    static const std::initializer_list<mapping> v = {
-        {GenericErrc::address_family_not_supported, "address_family_not_supported", {errc::address_family_not_supported}},
-        {GenericErrc::address_in_use, "address_in_use", {errc::address_in_use}},
-        {GenericErrc::address_not_available, "address_not_available", {errc::address_not_available}},
-        {GenericErrc::already_connected, "already_connected", {errc::already_connected}},
-        {GenericErrc::argument_list_too_long, "argument_list_too_long", {errc::argument_list_too_long}},
-        {GenericErrc::argument_out_of_domain, "argument_out_of_domain", {errc::argument_out_of_domain}},
-        {GenericErrc::bad_address, "bad_address", {errc::bad_address}},
-        {GenericErrc::bad_file_descriptor, "bad_file_descriptor", {errc::bad_file_descriptor}},
-        {GenericErrc::bad_message, "bad_message", {errc::bad_message}},
-        {GenericErrc::broken_pipe, "broken_pipe", {errc::broken_pipe}},
-        {GenericErrc::connection_aborted, "connection_aborted", {errc::connection_aborted}},
-        {GenericErrc::connection_already_in_progress, "connection_already_in_progress", {errc::connection_already_in_progress}},
-        {GenericErrc::connection_refused, "connection_refused", {errc::connection_refused}},
-        {GenericErrc::connection_reset, "connection_reset", {errc::connection_reset}},
-        {GenericErrc::cross_device_link, "cross_device_link", {errc::cross_device_link}},
-        {GenericErrc::destination_address_required, "destination_address_required", {errc::destination_address_required}},
-        {GenericErrc::device_or_resource_busy, "device_or_resource_busy", {errc::device_or_resource_busy}},
-        {GenericErrc::directory_not_empty, "directory_not_empty", {errc::directory_not_empty}},
-        {GenericErrc::executable_format_error, "executable_format_error", {errc::executable_format_error}},
-        {GenericErrc::file_exists, "file_exists", {errc::file_exists}},
-        {GenericErrc::file_too_large, "file_too_large", {errc::file_too_large}},
-        {GenericErrc::filename_too_long, "filename_too_long", {errc::filename_too_long}},
-        {GenericErrc::function_not_supported, "function_not_supported", {errc::function_not_supported}},
-        {GenericErrc::host_unreachable, "host_unreachable", {errc::host_unreachable}},
-        {GenericErrc::identifier_removed, "identifier_removed", {errc::identifier_removed}},
-        {GenericErrc::illegal_byte_sequence, "illegal_byte_sequence", {errc::illegal_byte_sequence}},
-        {GenericErrc::inappropriate_io_control_operation, "inappropriate_io_control_operation", {errc::inappropriate_io_control_operation}},
-        {GenericErrc::interrupted, "interrupted", {errc::interrupted}},
-        {GenericErrc::invalid_argument, "invalid_argument", {errc::invalid_argument}},
-        {GenericErrc::invalid_seek, "invalid_seek", {errc::invalid_seek}},
-        {GenericErrc::io_error, "io_error", {errc::io_error}},
-        {GenericErrc::is_a_directory, "is_a_directory", {errc::is_a_directory}},
-        {GenericErrc::message_size, "message_size", {errc::message_size}},
-        {GenericErrc::network_down, "network_down", {errc::network_down}},
-        {GenericErrc::network_reset, "network_reset", {errc::network_reset}},
-        {GenericErrc::network_unreachable, "network_unreachable", {errc::network_unreachable}},
-        {GenericErrc::no_buffer_space, "no_buffer_space", {errc::no_buffer_space}},
-        {GenericErrc::no_child_process, "no_child_process", {errc::no_child_process}},
-        {GenericErrc::no_link, "no_link", {errc::no_link}},
-        {GenericErrc::no_lock_available, "no_lock_available", {errc::no_lock_available}},
-        {GenericErrc::no_message, "no_message", {errc::no_message}},
-        {GenericErrc::no_protocol_option, "no_protocol_option", {errc::no_protocol_option}},
-        {GenericErrc::no_space_on_device, "no_space_on_device", {errc::no_space_on_device}},
-        {GenericErrc::no_stream_resources, "no_stream_resources", {errc::no_stream_resources}},
-        {GenericErrc::no_such_device_or_address, "no_such_device_or_address", {errc::no_such_device_or_address}},
-        {GenericErrc::no_such_device, "no_such_device", {errc::no_such_device}},
-        {GenericErrc::no_such_file_or_directory, "no_such_file_or_directory", {errc::no_such_file_or_directory}},
-        {GenericErrc::no_such_process, "no_such_process", {errc::no_such_process}},
-        {GenericErrc::not_a_directory, "not_a_directory", {errc::not_a_directory}},
-        {GenericErrc::not_a_socket, "not_a_socket", {errc::not_a_socket}},
-        {GenericErrc::not_a_stream, "not_a_stream", {errc::not_a_stream}},
-        {GenericErrc::not_connected, "not_connected", {errc::not_connected}},
-        {GenericErrc::not_enough_memory, "not_enough_memory", {errc::not_enough_memory}},
-        {GenericErrc::not_supported, "not_supported", {errc::not_supported}},
-        {GenericErrc::operation_canceled, "operation_canceled", {errc::operation_canceled}},
-        {GenericErrc::operation_in_progress, "operation_in_progress", {errc::operation_in_progress}},
-        {GenericErrc::operation_not_permitted, "operation_not_permitted", {errc::operation_not_permitted}},
-        {GenericErrc::operation_not_supported, "operation_not_supported", {errc::operation_not_supported}},
-        {GenericErrc::operation_would_block, "operation_would_block", {errc::operation_would_block}},
-        {GenericErrc::owner_dead, "owner_dead", {errc::owner_dead}},
-        {GenericErrc::permission_denied, "permission_denied", {errc::permission_denied}},
-        {GenericErrc::protocol_error, "protocol_error", {errc::protocol_error}},
-        {GenericErrc::protocol_not_supported, "protocol_not_supported", {errc::protocol_not_supported}},
-        {GenericErrc::read_only_file_system, "read_only_file_system", {errc::read_only_file_system}},
-        {GenericErrc::resource_deadlock_would_occur, "resource_deadlock_would_occur", {errc::resource_deadlock_would_occur}},
-        {GenericErrc::resource_unavailable_try_again, "resource_unavailable_try_again", {errc::resource_unavailable_try_again}},
-        {GenericErrc::result_out_of_range, "result_out_of_range", {errc::result_out_of_range}},
-        {GenericErrc::state_not_recoverable, "state_not_recoverable", {errc::state_not_recoverable}},
-        {GenericErrc::stream_timeout, "stream_timeout", {errc::stream_timeout}},
-        {GenericErrc::text_file_busy, "text_file_busy", {errc::text_file_busy}},
-        {GenericErrc::timed_out, "timed_out", {errc::timed_out}},
-        {GenericErrc::too_many_files_open_in_system, "too_many_files_open_in_system", {errc::too_many_files_open_in_system}},
-        {GenericErrc::too_many_files_open, "too_many_files_open", {errc::too_many_files_open}},
-        {GenericErrc::too_many_links, "too_many_links", {errc::too_many_links}},
-        {GenericErrc::too_many_symbolic_link_levels, "too_many_symbolic_link_levels", {errc::too_many_symbolic_link_levels}},
-        {GenericErrc::value_too_large, "value_too_large", {errc::value_too_large}},
-        {GenericErrc::wrong_protocol_type, "wrong_protocol_type", {errc::wrong_protocol_type}},
-    };
-    // clang-format on
-    // NOLINTEND
-    return v;
-  }
-};
-SYSTEM_ERROR2_NAMESPACE_END
+QUICK_STATUS_CODE_GENERIC(
+    GenericErrc, unknown, address_family_not_supported, address_in_use,
+    address_not_available, already_connected, argument_list_too_long,
+    argument_out_of_domain, bad_address, bad_file_descriptor, bad_message,
+    broken_pipe, connection_aborted, connection_already_in_progress,
+    connection_refused, connection_reset, cross_device_link,
+    destination_address_required, device_or_resource_busy, directory_not_empty,
+    executable_format_error, file_exists, file_too_large, filename_too_long,
+    function_not_supported, host_unreachable, identifier_removed,
+    illegal_byte_sequence, inappropriate_io_control_operation, interrupted,
+    invalid_argument, invalid_seek, io_error, is_a_directory, message_size,
+    network_down, network_reset, network_unreachable, no_buffer_space,
+    no_child_process, no_link, no_lock_available, no_message,
+    no_protocol_option, no_space_on_device, no_stream_resources,
+    no_such_device_or_address, no_such_device, no_such_file_or_directory,
+    no_such_process, not_a_directory, not_a_socket, not_a_stream, not_connected,
+    not_enough_memory, not_supported, operation_canceled, operation_in_progress,
+    operation_not_permitted, operation_not_supported, operation_would_block,
+    owner_dead, permission_denied, protocol_error, protocol_not_supported,
+    read_only_file_system, resource_deadlock_would_occur,
+    resource_unavailable_try_again, result_out_of_range, state_not_recoverable,
+    stream_timeout, text_file_busy, timed_out, too_many_files_open_in_system,
+    too_many_files_open, too_many_links, too_many_symbolic_link_levels,
+    value_too_large, wrong_protocol_type)
@@ -0,0 +1,433 @@
+// Benchmarks Result/TRY against C++ exceptions and std::expected, printing
+// one JSON record per measurement:
+//
+//   outcome_bench --depths=1,8,64 --iterations=1000000
+//
+// Every mechanism runs the same recursive call chain, which either succeeds
+// or fails at its leaf. Allocations are counted through the global operator
+// new in an untimed pass of their own; the runtime allocates thrown exception
+// objects with malloc directly, which the records of the exception mechanism
+// note as uncounted. Code size is read from the symbol table of the binary
+// itself, so it is only reported when the binary is not stripped.
+
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <elf.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <expected>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "bench.hh"
+#include "outcome.hh"
+
+ABSL_FLAG(std::vector<std::string>, depths,
+          std::vector<std::string>({"1", "4", "16", "64"}),
+          "Depths of the call chain between the failure and its handler");
+ABSL_FLAG(std::vector<std::string>, mechanisms,
+          std::vector<std::string>({"status_quick", "status_enum",
+                                    "status_payload", "status_anyhow",
+                                    "exception", "expected"}),
+          "Error mechanisms to measure");
+ABSL_FLAG(uint64_t, iterations, 1000000, "Calls per measurement");
+ABSL_FLAG(std::string, output, "", "Write JSON here instead of stdout");
+
+namespace {
+
+using bench::AllocationCounter;
+using bench::Reporter;
+using bench::sink;
+using bench::time_per_op;
+
+// calls of an allocation count, which is the same for every call
+constexpr uint64_t kCountedCalls = 10000;
+
+// Each mechanism is a leaf which fails when asked to and a chain which
+// forwards the leaf's result up `depth` frames, adding one per frame. They
+// are kept out of line so that every frame really exists and the symbol
+// table holds their size.
+
+// returns the enum itself, converted through quick_status_code_from_enum
+[[gnu::noinline]] Result<int> status_quick_leaf(int x, bool fail) {
+  if (fail) {
+    return GenericErrc::io_error;
+  }
+  return x;
+}
+
+[[gnu::noinline]] Result<int> status_quick_chain(int depth, int x,
+                                                 bool fail) {
+  if (depth == 0) {
+    return status_quick_leaf(x, fail);
+  }
+  TRY(auto v, status_quick_chain(depth - 1, x, fail));
+  return v + 1;
+}
+
+[[gnu::noinline]] Result<int> status_enum_leaf(int x, bool fail) {
+  if (fail) {
+    return make_error(GenericErrc::io_error);
+  }
+  return x;
+}
+
+[[gnu::noinline]] Result<int> status_enum_chain(int depth, int x, bool fail) {
+  if (depth == 0) {
+    return status_enum_leaf(x, fail);
+  }
+  TRY(auto v, status_enum_chain(depth - 1, x, fail));
+  return v + 1;
+}
+
+[[gnu::noinline]] Result<int> status_payload_leaf(int x, bool fail) {
+  if (fail) {
+    return make_error(GenericErrc::io_error, "short read");
+  }
+  return x;
+}
+
+[[gnu::noinline]] Result<int> status_payload_chain(int depth, int x,
+                                                   bool fail) {
+  if (depth == 0) {
+    return status_payload_leaf(x, fail);
+  }
+  TRY(auto v, status_payload_chain(depth - 1, x, fail));
+  return v + 1;
+}
+
+[[gnu::noinline]] Result<int> status_anyhow_leaf(int x, bool fail) {
+  if (fail) {
+    return make_error("short read");
+  }
+  return x;
+}
+
+[[gnu::noinline]] Result<int> status_anyhow_chain(int depth, int x,
+                                                  bool fail) {
+  if (depth == 0) {
+    return status_anyhow_leaf(x, fail);
+  }
+  TRY(auto v, status_anyhow_chain(depth - 1, x, fail));
+  return v + 1;
+}
+
+[[gnu::noinline]] int exception_leaf(int x, bool fail) {
+  if (fail) {
+    throw std::system_error(std::make_error_code(std::errc::io_error));
+  }
+  return x;
+}
+
+[[gnu::noinline]] int exception_chain(int depth, int x, bool fail) {
+  if (depth == 0) {
+    return exception_leaf(x, fail);
+  }
+  return exception_chain(depth - 1, x, fail) + 1;
+}
+
+[[gnu::noinline]] std::expected<int, GenericErrc> expected_leaf(int x,
+                                                                bool fail) {
+  if (fail) {
+    return std::unexpected(GenericErrc::io_error);
+  }
+  return x;
+}
+
+[[gnu::noinline]] std::expected<int, GenericErrc> expected_chain(int depth,
+                                                                 int x,
+                                                                 bool fail) {
+  if (depth == 0) {
+    return expected_leaf(x, fail);
+  }
+  auto v = expected_chain(depth - 1, x, fail);
+  if (!v) {
+    return std::unexpected(v.error());
+  }
+  return *v + 1;
+}
+
+/// call the chain of a mechanism and return its value, or -1 on failure
+template <typename F>
+int call_result(F &&chain, int depth, int x, bool fail) {
+  auto r = chain(depth, x, fail);
+  return r ? r.value() : -1;
+}
+
+int call_exception(int depth, int x, bool fail) {
+  try {
+    return exception_chain(depth, x, fail);
+  } catch (const std::system_error &) {
+    return -1;
+  }
+}
+
+struct Mechanism {
+  std::string_view name;
+  int (*call)(int depth, int x, bool fail);
+  // constructs and drops one error, or nullptr
+  void (*construct)();
+  // renders the message of one error twice, or nullptr
+  size_t (*message)();
+  // what a failure allocates which operator new doesn't see, if anything
+  std::string_view uncounted = {};
+};
+
+template <typename E>
+size_t render_twice(const E &e) {
+  auto first = e.message();
+  auto second = e.message();
+  return first.size() + second.size();
+}
+
+const Mechanism kMechanisms[] = {
+    {"status_quick",
+     [](int depth, int x, bool fail) {
+       return call_result(status_quick_chain, depth, x, fail);
+     },
+     [] {
+       Result<void> r = GenericErrc::io_error;
+       sink += r.has_error();
+     },
+     [] { return render_twice(Result<void>(GenericErrc::io_error).error()); }},
+    {"status_enum",
+     [](int depth, int x, bool fail) {
+       return call_result(status_enum_chain, depth, x, fail);
+     },
+     [] {
+       auto e = make_error(GenericErrc::io_error);
+       sink += e.failure();
+     },
+     [] { return render_twice(make_error(GenericErrc::io_error)); }},
+    {"status_payload",
+     [](int depth, int x, bool fail) {
+       return call_result(status_payload_chain, depth, x, fail);
+     },
+     [] {
+       auto e = make_error(GenericErrc::io_error, "short read");
+       sink += e.failure();
+     },
+     [] { return render_twice(make_error(GenericErrc::io_error, "short")); }},
+    {"status_anyhow",
+     [](int depth, int x, bool fail) {
+       return call_result(status_anyhow_chain, depth, x, fail);
+     },
+     [] {
+       auto e = make_error("short read");
+       sink += e.failure();
+     },
+     [] { return render_twice(make_error("short read")); }},
+    {"exception", call_exception,
+     [] {
+       std::system_error e(std::make_error_code(std::errc::io_error));
+       sink += e.code().value();
+     },
+     [] {
+       std::system_error e(std::make_error_code(std::errc::io_error));
+       return std::strlen(e.what()) + e.code().message().size();
+     },
+     "the thrown exception object, from __cxa_allocate_exception"},
+    {"expected",
+     [](int depth, int x, bool fail) {
+       auto r = expected_chain(depth, x, fail);
+       return r ? *r : -1;
+     },
+     nullptr, nullptr},
+};
+
+/// sizes of the functions in the symbol table of this binary, by mangled
+/// name; empty when the binary is stripped
+std::map<std::string, uint64_t> function_sizes() {
+  std::map<std::string, uint64_t> sizes;
+  std::ifstream in("/proc/self/exe", std::ios::binary);
+  std::vector<char> image((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+  if (image.size() < sizeof(Elf64_Ehdr) ||
+      std::memcmp(image.data(), ELFMAG, SELFMAG) != 0 ||
+      image[EI_CLASS] != ELFCLASS64) {
+    return sizes;
+  }
+  auto read = [&]<typename T>(uint64_t offset, T &out) {
+    if (offset + sizeof(T) > image.size()) {
+      return false;
+    }
+    std::memcpy(&out, image.data() + offset, sizeof(T));
+    return true;
+  };
+
+  Elf64_Ehdr header;
+  read(0, header);
+  for (uint32_t i = 0; i < header.e_shnum; i++) {
+    Elf64_Shdr symtab;
+    Elf64_Shdr strtab;
+    if (!read(header.e_shoff + i * header.e_shentsize, symtab) ||
+        symtab.sh_type != SHT_SYMTAB ||
+        !read(header.e_shoff + symtab.sh_link * header.e_shentsize, strtab)) {
+      continue;
+    }
+    for (uint64_t off = 0; off + sizeof(Elf64_Sym) <= symtab.sh_size;
+         off += sizeof(Elf64_Sym)) {
+      Elf64_Sym sym;
+      if (!read(symtab.sh_offset + off, sym) ||
+          ELF64_ST_TYPE(sym.st_info) != STT_FUNC ||
+          strtab.sh_offset + sym.st_name >= image.size()) {
+        continue;
+      }
+      const auto *name = image.data() + strtab.sh_offset + sym.st_name;
+      sizes[std::string(name, strnlen(name, image.size() -
+                                                strtab.sh_offset -
+                                                sym.st_name))] = sym.st_size;
+    }
+  }
+  return sizes;
+}
+
+/// bytes of the out of line functions whose names contain `prefix`_leaf or
+/// `prefix`_chain
+uint64_t code_size(const std::map<std::string, uint64_t> &sizes,
+                   std::string_view prefix) {
+  uint64_t total = 0;
+  auto leaf = fmt::format("{}_leaf", prefix);
+  auto chain = fmt::format("{}_chain", prefix);
+  for (const auto &[name, size] : sizes) {
+    if (name.find(leaf) != std::string::npos ||
+        name.find(chain) != std::string::npos) {
+      total += size;
+    }
+  }
+  return total;
+}
+
+/// allocations per call of `f`, in an untimed pass of its own
+template <typename F>
+double allocations_per_op(uint64_t ops, F &&f) {
+  AllocationCounter counter;
+  f();
+  return static_cast<double>(counter.allocations()) /
+         static_cast<double>(std::max<uint64_t>(ops, 1));
+}
+
+void run(const Mechanism &m, const std::vector<int> &depths,
+         uint64_t iterations,
+         const std::map<std::string, uint64_t> &sizes, Reporter &reporter) {
+  auto counted = std::min(iterations, kCountedCalls);
+  auto report = [&](int depth, std::string_view metric, double value,
+                    std::string_view unit, std::string_view uncounted = {}) {
+    auto labels =
+        fmt::format(R"("mechanism": "{}", "depth": {})", m.name, depth);
+    if (!uncounted.empty()) {
+      labels += fmt::format(R"(, "uncounted": "{}")", uncounted);
+    }
+    reporter.report(labels, metric, value, unit);
+  };
+
+  for (auto depth : depths) {
+    for (auto fail : {false, true}) {
+      auto metric = fail ? "failure" : "success";
+      auto calls = [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+          sum += m.call(depth, static_cast<int>(i), fail);
+        }
+        sink += sum;
+      };
+      report(depth, metric, time_per_op(iterations, [&] { calls(iterations); }),
+             "ns/op");
+      report(depth, fmt::format("{}_allocations", metric),
+             allocations_per_op(counted, [&] { calls(counted); }),
+             "allocs/op", fail ? m.uncounted : std::string_view{});
+    }
+  }
+
+  // a single error has no depth, report it as 0
+  if (m.construct) {
+    auto constructs = [&](uint64_t n) {
+      for (uint64_t i = 0; i < n; i++) {
+        m.construct();
+      }
+    };
+    report(0, "make_error",
+           time_per_op(iterations, [&] { constructs(iterations); }),
+           "ns/op");
+    report(0, "make_error_allocations",
+           allocations_per_op(counted, [&] { constructs(counted); }),
+           "allocs/op");
+  }
+
+  if (m.message) {
+    auto messages = [&](uint64_t n) {
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < n; i++) {
+        sum += m.message();
+      }
+      sink += sum;
+    };
+    auto rounds = std::max<uint64_t>(iterations / 10, 1);
+    report(0, "message_twice",
+           time_per_op(rounds, [&] { messages(rounds); }), "ns/op");
+    report(0, "message_twice_allocations",
+           allocations_per_op(counted, [&] { messages(counted); }),
+           "allocs/op");
+  }
+
+  if (auto size = code_size(sizes, m.name); size > 0) {
+    report(0, "code_size", static_cast<double>(size), "bytes");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  absl::SetProgramUsageMessage(
+      "benchmark Result/TRY against exceptions and std::expected");
+  absl::ParseCommandLine(argc, argv);
+
+  auto output = absl::GetFlag(FLAGS_output);
+  std::FILE *out = stdout;
+  if (!output.empty()) {
+    out = std::fopen(output.c_str(), "w");
+    if (!out) {
+      fmt::print(stderr, "can not open {}: {}\n", output, strerror(errno));
+      return 1;
+    }
+  }
+
+  std::vector<int> depths;
+  for (const auto &depth : absl::GetFlag(FLAGS_depths)) {
+    depths.push_back(std::stoi(depth));
+  }
+  auto sizes = function_sizes();
+  if (sizes.empty()) {
+    fmt::print(stderr, "no symbol table, code size is not reported\n");
+  }
+
+  {
+    Reporter reporter(out);
+    for (const auto &name : absl::GetFlag(FLAGS_mechanisms)) {
+      const auto *m = std::find_if(
+          std::begin(kMechanisms), std::end(kMechanisms),
+          [&](const Mechanism &m) { return m.name == name; });
+      if (m == std::end(kMechanisms)) {
+        fmt::print(stderr, "unknown mechanism {}\n", name);
+        return 1;
+      }
+      run(*m, depths, absl::GetFlag(FLAGS_iterations), sizes, reporter);
+    }
+  }
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+}
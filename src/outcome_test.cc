@@ -7,27 +7,7 @@ enum class MyErrc : uint8_t {
   Err2,
 };
 
-SYSTEM_ERROR2_NAMESPACE_BEGIN
-template <>
-struct quick_status_code_from_enum<MyErrc>
-    : quick_status_code_from_enum_defaults<MyErrc> {
-  static constexpr auto domain_name = "MyErrc";
-  // 0x97f3b4b353c531f
-  static constexpr auto domain_uuid = "455bc461-b14e-4e59-b46e-073205fdb9c9";
-  // 0xd49fd48947f82a34 ^ 0xc44f7bdeb2cc50e9 = 0x10d0af57f5347add
-  static constexpr auto payload_uuid = "fa0c63b4-1e0b-49ee-b9ae-ecc08646b0a3";
-  static constexpr bool all_failures = true;
-  static const std::initializer_list<mapping>& value_mappings() {
-    // NOLINTBEGIN
-    static const std::initializer_list<mapping> v = {
-        {MyErrc::Err1, "Err1", {}},
-        {MyErrc::Err2, "Err2", {}},
-    };
-    // NOLINTEND
-    return v;
-  }
-};
-SYSTEM_ERROR2_NAMESPACE_END
+QUICK_STATUS_CODE(MyErrc, Err1, Err2)
 
 using MyError = SYSTEM_ERROR2_NAMESPACE::EnumPayloadError<MyErrc, std::string>;
 
@@ -120,3 +100,104 @@ TEST(outcome, test) {
   // fmt::println("err4: {}", err4);
   // fmt::println("err5: {}", err5);
 }
+
+TEST(outcome, message) {
+  auto r = f0();
+  ASSERT_TRUE(r.has_failure());
+  auto m0 = r.error().message();
+  auto m1 = r.error().message();
+  std::string_view message{m0.data(), m0.size()};
+  EXPECT_TRUE(message.starts_with("outcome_test.cc:")) << message;
+  EXPECT_TRUE(message.ends_with(" Err1 foo")) << message;
+  EXPECT_EQ(m0.c_str()[m0.size()], '\0');
+  // rendered once, then shared
+  EXPECT_EQ(m0.data(), m1.data());
+
+  fmt::memory_buffer out;
+  auto e = make_error(MyErrc::Err2, "bar");
+  format_to(out, e);
+  EXPECT_TRUE(std::string_view(out.data(), out.size()).ends_with(" Err2 bar"));
+  format_to(out, r.error());
+  EXPECT_TRUE(std::string_view(out.data(), out.size()).ends_with(message));
+}
+
+TEST(outcome, quick_status_code) {
+  using Quick = SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum<MyErrc>;
+  EXPECT_STREQ(Quick::domain_name, "MyErrc");
+  EXPECT_EQ(std::string_view(Quick::domain_uuid).size(), 36);
+  EXPECT_STRNE(Quick::domain_uuid, Quick::payload_uuid);
+
+  auto e = make_error(MyErrc::Err2);
+  auto message = e.message();
+  EXPECT_TRUE(std::string_view(message.data(), message.size()).ends_with(
+      " Err2"));
+
+  using SYSTEM_ERROR2_NAMESPACE::errc;
+  using SYSTEM_ERROR2_NAMESPACE::generic_code;
+  auto timed_out = make_error(GenericErrc::timed_out);
+  EXPECT_EQ(timed_out, generic_code(errc::timed_out));
+  EXPECT_NE(timed_out, generic_code(errc::io_error));
+}
+
+TEST(outcome, generic_equivalence) {
+  using SYSTEM_ERROR2_NAMESPACE::errc;
+  using SYSTEM_ERROR2_NAMESPACE::generic_code;
+  using Quick =
+      SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum<GenericErrc>;
+  for (const auto &m : Quick::value_mappings()) {
+    auto e = make_error(m.value);
+    EXPECT_EQ(e, generic_code(*m.code_mappings.begin())) << m.message;
+    EXPECT_EQ(e.generic_code(), generic_code(*m.code_mappings.begin()));
+    if (m.value != GenericErrc::io_error) {
+      EXPECT_NE(e, generic_code(errc::io_error)) << m.message;
+    }
+    Result<void> r = e;
+    EXPECT_EQ(r.error(), generic_code(*m.code_mappings.begin()));
+  }
+}
+
+Result<void> read_config() {
+  return context(f0(), "reading the config");
+}
+
+Result<void> start() {
+  TRYV(context(read_config(), "starting"));
+  return OUTCOME_V2_NAMESPACE::success();
+}
+
+TEST(outcome, context) {
+  auto r = start();
+  ASSERT_TRUE(r.has_failure());
+  auto m = r.error().message();
+  std::string_view message{m.data(), m.size()};
+  EXPECT_TRUE(message.starts_with("outcome_test.cc:")) << message;
+  auto starting = message.find(" starting: ");
+  auto reading = message.find(" reading the config: ");
+  auto error = message.find(" Err1 foo");
+  EXPECT_LT(starting, reading) << message;
+  EXPECT_LT(reading, error) << message;
+  EXPECT_NE(error, std::string_view::npos) << message;
+
+  // still the wrapped error
+  EXPECT_EQ(r.error(), make_error(MyErrc::Err1));
+  EXPECT_NE(r.error(), make_error(MyErrc::Err2));
+
+  // recognized behind the indirecting domain and rendered without message()
+  using SYSTEM_ERROR2_NAMESPACE::is_nested_context;
+  EXPECT_TRUE(is_nested_context(r.error()));
+  EXPECT_FALSE(is_nested_context(f0().error()));
+  fmt::memory_buffer out;
+  format_to(out, r.error());
+  EXPECT_EQ(std::string_view(out.data(), out.size()), message);
+
+  // frames past the inline ones are only counted
+  Result<void> deep = f2();
+  for (size_t i = 0; i < 10; i++) {
+    deep = context(std::move(deep), "layer");
+  }
+  auto d = deep.error().message();
+  EXPECT_TRUE(std::string_view(d.data(), d.size()).starts_with("(2 more): "));
+
+  Result<int> ok = 1;
+  EXPECT_EQ(context(std::move(ok), "unused").value(), 1);
+}
@@ -0,0 +1,564 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "intrusive-ptr.hh"
+
+/**
+ * BTree is a persistent B+-tree with the same snapshot semantics as RBTree:
+ * copying a tree is O(1), and an update copies the nodes on the path from the
+ * root to the modified leaf while sharing every other node with the older
+ * versions.
+ *
+ * Nodes are sized in whole cache lines and hold up to `kSlots` keys, so a
+ * lookup in a tree of 10M keys touches 6 nodes instead of ~25. Keys inside a
+ * node are searched with a branch free linear scan, which uses AVX2 compares
+ * when they are available.
+ */
+class BTree {
+public:
+  static constexpr uint32_t kSlots = 15;
+
+  BTree() = default;
+  BTree(const BTree &) = default;
+  BTree &operator=(const BTree &) = default;
+
+  BTree(BTree &&other) noexcept
+      : root_(std::move(other.root_)), count_(std::exchange(other.count_, 0)) {}
+
+  BTree &operator=(BTree &&other) noexcept {
+    root_ = std::move(other.root_);
+    count_ = std::exchange(other.count_, 0);
+    return *this;
+  }
+
+  void insert(uint64_t key, uint64_t value) {
+    if (!root_) {
+      auto leaf = IntrusivePtr<Leaf>::make();
+      leaf->insert_at(0, key, value);
+      root_ = std::move(leaf);
+      count_ = 1;
+      return;
+    }
+    auto res = insert_into(root_, key, value);
+    if (res.split) {
+      // the root overflowed, grow the tree by one level
+      auto root = IntrusivePtr<Inner>::make();
+      root->count = 2;
+      root->keys[0] = res.split_key;
+      root->children[0] = std::move(res.node);
+      root->children[1] = std::move(res.split);
+      root_ = std::move(root);
+    } else {
+      root_ = std::move(res.node);
+    }
+    if (res.inserted) {
+      count_++;
+    }
+  }
+
+  bool remove(uint64_t key) {
+    if (!root_) {
+      return false;
+    }
+    auto new_root = remove_from(root_, key);
+    if (!new_root) {
+      return false;
+    }
+    count_--;
+    if (new_root->count == 0) {
+      root_ = nullptr;
+    } else if (!new_root->leaf && new_root->count == 1) {
+      // the root lost its last separator, shrink the tree by one level
+      root_ = static_cast<const Inner &>(*new_root).children[0];
+    } else {
+      root_ = std::move(new_root);
+    }
+    return true;
+  }
+
+  std::optional<uint64_t> get(uint64_t key) const {
+    const auto *node = root_.get();
+    if (!node) {
+      return std::nullopt;
+    }
+    while (!node->leaf) {
+      const auto &inner = static_cast<const Inner &>(*node);
+      node = inner.children[inner.child_index(key)].get();
+    }
+    const auto &leaf = static_cast<const Leaf &>(*node);
+    auto idx = count_less(leaf.keys, key);
+    if (idx < leaf.count && leaf.keys[idx] == key) {
+      return leaf.values[idx];
+    }
+    return std::nullopt;
+  }
+
+  bool empty() const {
+    return count_ == 0;
+  }
+
+  uint64_t size() const {
+    return count_;
+  }
+
+  /// visit every entry in key order
+  template <typename F>
+  void for_each(F &&f) const {
+    if (root_) {
+      for_each(*root_, f);
+    }
+  }
+
+  bool is_valid() const {
+    if (!root_) {
+      return count_ == 0;
+    }
+    uint64_t count = 0;
+    int depth = -1;
+    return check_invariant(*root_, 0, std::numeric_limits<uint64_t>::max(),
+                           true, 0, depth, count) &&
+           count == count_;
+  }
+
+private:
+  static constexpr uint64_t kEmptyKey = std::numeric_limits<uint64_t>::max();
+  static constexpr uint32_t kMinKeys = kSlots / 2;
+  static constexpr uint32_t kMinChildren = (kSlots + 1) / 2;
+
+  // one extra slot which always holds kEmptyKey, so the SIMD scan can read
+  // the keys four at a time
+  using Keys = std::array<uint64_t, kSlots + 1>;
+
+  /// number of keys less than `key`, unused slots hold kEmptyKey
+  static uint32_t count_less(const Keys &keys, uint64_t key) {
+#if defined(__AVX2__)
+    // AVX2 only compares signed integers, flip the sign bits of both sides
+    const auto bias = _mm256_set1_epi64x(std::numeric_limits<int64_t>::min());
+    const auto needle = _mm256_xor_si256(
+        _mm256_set1_epi64x(static_cast<int64_t>(key)), bias);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < keys.size(); i += 4) {
+      auto v = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&keys[i])),
+          bias);
+      auto less = _mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, v));
+      count += __builtin_popcount(_mm256_movemask_pd(less));
+    }
+    return count;
+#else
+    uint32_t count = 0;
+    for (auto k : keys) {
+      count += k < key ? 1 : 0;
+    }
+    return count;
+#endif
+  }
+
+  struct alignas(64) Node {
+    Keys keys;
+    // the reference count and the header fill the padding after the keys,
+    // which keeps a leaf at 256 bytes
+    std::atomic<uint32_t> refs_{0};
+    // number of keys in a leaf, number of children in an inner node
+    uint16_t count = 0;
+    bool leaf;
+
+    explicit Node(bool leaf) : leaf(leaf) {
+      keys.fill(kEmptyKey);
+    }
+
+    // a copy starts unreferenced
+    Node(const Node &other)
+        : keys(other.keys), count(other.count), leaf(other.leaf) {}
+    Node &operator=(const Node &) = delete;
+
+    /// nodes are freed through the base, by their actual type
+    static void destroy(Node *node);
+  };
+
+  // nodes are never updated once they are shared
+  using Ptr = IntrusivePtr<Node>;
+
+  struct Leaf : Node {
+    std::array<uint64_t, kSlots> values{};
+
+    Leaf() : Node(true) {}
+
+    void insert_at(uint32_t idx, uint64_t key, uint64_t value) {
+      assert(count < kSlots);
+      for (uint32_t i = count; i > idx; i--) {
+        keys[i] = keys[i - 1];
+        values[i] = values[i - 1];
+      }
+      keys[idx] = key;
+      values[idx] = value;
+      count++;
+    }
+
+    void erase_at(uint32_t idx) {
+      assert(idx < count);
+      for (auto i = idx; i + 1 < count; i++) {
+        keys[i] = keys[i + 1];
+        values[i] = values[i + 1];
+      }
+      count--;
+      keys[count] = kEmptyKey;
+    }
+  };
+
+  struct Inner : Node {
+    // children[i] holds the keys in [keys[i - 1], keys[i])
+    std::array<Ptr, kSlots + 1> children{};
+
+    Inner() : Node(false) {}
+
+    uint32_t child_index(uint64_t key) const {
+      // separators not greater than `key`, the `count - 1` valid separators
+      // bound the result since kEmptyKey may itself be a key
+      if (key == kEmptyKey) {
+        return count - 1;
+      }
+      return count_less(keys, key + 1);
+    }
+
+    void insert_at(uint32_t idx, uint64_t separator, Ptr child) {
+      // insert `separator` at keys[idx] and `child` at children[idx + 1]
+      assert(count <= kSlots);
+      for (uint32_t i = count; i > idx + 1; i--) {
+        children[i] = std::move(children[i - 1]);
+      }
+      for (uint32_t i = count - 1; i > idx; i--) {
+        keys[i] = keys[i - 1];
+      }
+      keys[idx] = separator;
+      children[idx + 1] = std::move(child);
+      count++;
+    }
+
+    void erase_at(uint32_t idx) {
+      // erase keys[idx] and children[idx + 1]
+      assert(idx + 1 < count);
+      for (auto i = idx; i + 2 < count; i++) {
+        keys[i] = keys[i + 1];
+      }
+      for (auto i = idx + 1; i + 1 < count; i++) {
+        children[i] = std::move(children[i + 1]);
+      }
+      count--;
+      keys[count - 1] = kEmptyKey;
+      children[count] = nullptr;
+    }
+  };
+
+  static_assert(sizeof(Leaf) == 256, "a leaf spans four cache lines");
+
+  struct InsertResult {
+    Ptr node;
+    // right sibling split off from `node` and its first key
+    Ptr split;
+    uint64_t split_key;
+    bool inserted;
+  };
+
+  static InsertResult insert_into(const Ptr &node, uint64_t key,
+                                  uint64_t value) {
+    if (node->leaf) {
+      const auto &leaf = static_cast<const Leaf &>(*node);
+      auto idx = count_less(leaf.keys, key);
+      auto copy = IntrusivePtr<Leaf>::make(leaf);
+      if (idx < leaf.count && leaf.keys[idx] == key) {
+        copy->values[idx] = value;
+        return {std::move(copy), nullptr, 0, false};
+      }
+      if (leaf.count < kSlots) {
+        copy->insert_at(idx, key, value);
+        return {std::move(copy), nullptr, 0, true};
+      }
+      return split_leaf(std::move(copy), idx, key, value);
+    }
+
+    const auto &inner = static_cast<const Inner &>(*node);
+    auto idx = inner.child_index(key);
+    auto res = insert_into(inner.children[idx], key, value);
+    auto copy = IntrusivePtr<Inner>::make(inner);
+    copy->children[idx] = std::move(res.node);
+    if (!res.split) {
+      return {std::move(copy), nullptr, 0, res.inserted};
+    }
+    if (copy->count <= kSlots) {
+      copy->insert_at(idx, res.split_key, std::move(res.split));
+      return {std::move(copy), nullptr, 0, res.inserted};
+    }
+    auto split = split_inner(std::move(copy), idx, res.split_key,
+                             std::move(res.split));
+    split.inserted = res.inserted;
+    return split;
+  }
+
+  static InsertResult split_leaf(IntrusivePtr<Leaf> left, uint32_t idx,
+                                 uint64_t key, uint64_t value) {
+    constexpr uint32_t kLeft = (kSlots + 1) / 2;
+    auto right = IntrusivePtr<Leaf>::make();
+    // move the upper half to the right sibling, then insert into the half the
+    // new key belongs to
+    auto move_from = idx < kLeft ? kLeft - 1 : kLeft;
+    for (auto i = move_from; i < kSlots; i++) {
+      right->keys[i - move_from] = left->keys[i];
+      right->values[i - move_from] = left->values[i];
+      left->keys[i] = kEmptyKey;
+    }
+    right->count = kSlots - move_from;
+    left->count = move_from;
+    if (idx < kLeft) {
+      left->insert_at(idx, key, value);
+    } else {
+      right->insert_at(idx - move_from, key, value);
+    }
+    auto split_key = right->keys[0];
+    return {std::move(left), std::move(right), split_key, true};
+  }
+
+  static InsertResult split_inner(IntrusivePtr<Inner> node, uint32_t idx,
+                                  uint64_t separator, Ptr child) {
+    // lay out the overflowing node, then cut it in two
+    constexpr uint32_t kChildren = kSlots + 2;
+    std::array<uint64_t, kChildren - 1> keys{};
+    std::array<Ptr, kChildren> children{};
+    for (uint32_t i = 0, j = 0; i < kChildren - 1; i++) {
+      keys[i] = i == idx ? separator : node->keys[j++];
+    }
+    for (uint32_t i = 0, j = 0; i < kChildren; i++) {
+      children[i] = i == idx + 1 ? std::move(child)
+                                 : std::move(node->children[j++]);
+    }
+
+    constexpr uint32_t kLeft = kChildren / 2;
+    auto right = IntrusivePtr<Inner>::make();
+    node->keys.fill(kEmptyKey);
+    for (uint32_t i = 0; i < kLeft; i++) {
+      node->children[i] = std::move(children[i]);
+      if (i + 1 < kLeft) {
+        node->keys[i] = keys[i];
+      }
+    }
+    for (uint32_t i = kLeft; i < node->children.size(); i++) {
+      node->children[i] = nullptr;
+    }
+    node->count = kLeft;
+    for (uint32_t i = kLeft; i < kChildren; i++) {
+      right->children[i - kLeft] = std::move(children[i]);
+      if (i + 1 < kChildren) {
+        right->keys[i - kLeft] = keys[i];
+      }
+    }
+    right->count = kChildren - kLeft;
+    return {std::move(node), std::move(right), keys[kLeft - 1], true};
+  }
+
+  /// returns the copied node, or nullptr if `key` is not in the subtree
+  static Ptr remove_from(const Ptr &node, uint64_t key) {
+    if (node->leaf) {
+      const auto &leaf = static_cast<const Leaf &>(*node);
+      auto idx = count_less(leaf.keys, key);
+      if (idx >= leaf.count || leaf.keys[idx] != key) {
+        return nullptr;
+      }
+      auto copy = IntrusivePtr<Leaf>::make(leaf);
+      copy->erase_at(idx);
+      return copy;
+    }
+
+    const auto &inner = static_cast<const Inner &>(*node);
+    auto idx = inner.child_index(key);
+    auto child = remove_from(inner.children[idx], key);
+    if (!child) {
+      return nullptr;
+    }
+    auto copy = IntrusivePtr<Inner>::make(inner);
+    auto underflow =
+        child->count < (child->leaf ? kMinKeys : kMinChildren);
+    copy->children[idx] = child;
+    if (underflow) {
+      rebalance(*copy, idx, std::move(child));
+    }
+    return copy;
+  }
+
+  /// refill `child`, the freshly copied children[idx] of `parent`, from one
+  /// of its siblings
+  static void rebalance(Inner &parent, uint32_t idx,
+                        Ptr child) {
+    // always operate on a (left, right) pair of adjacent children
+    auto left_idx = idx > 0 ? idx - 1 : idx;
+    auto right_idx = left_idx + 1;
+    auto &separator = parent.keys[left_idx];
+
+    Ptr left;
+    Ptr right;
+    if (left_idx == idx) {
+      left = std::move(child);
+      right = copy_node(*parent.children[right_idx]);
+    } else {
+      left = copy_node(*parent.children[left_idx]);
+      right = std::move(child);
+    }
+
+    if (left->leaf) {
+      auto &l = static_cast<Leaf &>(*left);
+      auto &r = static_cast<Leaf &>(*right);
+      if (l.count + r.count <= kSlots) {
+        for (uint32_t i = 0; i < r.count; i++) {
+          l.insert_at(l.count, r.keys[i], r.values[i]);
+        }
+        parent.children[left_idx] = std::move(left);
+        parent.erase_at(left_idx);
+        return;
+      }
+      if (l.count < r.count) {
+        l.insert_at(l.count, r.keys[0], r.values[0]);
+        r.erase_at(0);
+      } else {
+        r.insert_at(0, l.keys[l.count - 1], l.values[l.count - 1]);
+        l.erase_at(l.count - 1);
+      }
+      separator = r.keys[0];
+    } else {
+      auto &l = static_cast<Inner &>(*left);
+      auto &r = static_cast<Inner &>(*right);
+      if (l.count + r.count <= kSlots + 1) {
+        // pull the separator down between the two halves
+        l.keys[l.count - 1] = separator;
+        for (uint32_t i = 0; i < r.count; i++) {
+          l.children[l.count + i] = std::move(r.children[i]);
+          if (i + 1 < r.count) {
+            l.keys[l.count + i] = r.keys[i];
+          }
+        }
+        l.count += r.count;
+        parent.children[left_idx] = std::move(left);
+        parent.erase_at(left_idx);
+        return;
+      }
+      if (l.count < r.count) {
+        // rotate the first child of `r` through the separator
+        l.keys[l.count - 1] = separator;
+        l.children[l.count] = r.children[0];
+        l.count++;
+        separator = r.keys[0];
+        r.keys[0] = kEmptyKey;
+        // shift `r` left by one child
+        for (uint32_t i = 0; i + 1 < r.count; i++) {
+          r.children[i] = std::move(r.children[i + 1]);
+          if (i + 2 < r.count) {
+            r.keys[i] = r.keys[i + 1];
+          }
+        }
+        r.count--;
+        r.children[r.count] = nullptr;
+        r.keys[r.count - 1] = kEmptyKey;
+      } else {
+        // rotate the last child of `l` through the separator
+        auto moved = std::move(l.children[l.count - 1]);
+        auto new_separator = l.keys[l.count - 2];
+        l.keys[l.count - 2] = kEmptyKey;
+        l.count--;
+        r.insert_at(0, separator, std::move(moved));
+        // insert_at placed the child second, swap it to the front
+        std::swap(r.children[0], r.children[1]);
+        separator = new_separator;
+      }
+    }
+    parent.children[left_idx] = std::move(left);
+    parent.children[right_idx] = std::move(right);
+  }
+
+  static Ptr copy_node(const Node &node) {
+    if (node.leaf) {
+      return IntrusivePtr<Leaf>::make(static_cast<const Leaf &>(node));
+    }
+    return IntrusivePtr<Inner>::make(static_cast<const Inner &>(node));
+  }
+
+  template <typename F>
+  static void for_each(const Node &node, F &f) {
+    if (node.leaf) {
+      const auto &leaf = static_cast<const Leaf &>(node);
+      for (uint32_t i = 0; i < leaf.count; i++) {
+        f(leaf.keys[i], leaf.values[i]);
+      }
+      return;
+    }
+    const auto &inner = static_cast<const Inner &>(node);
+    for (uint32_t i = 0; i < inner.count; i++) {
+      for_each(*inner.children[i], f);
+    }
+  }
+
+  /// every key of `node` must be in [lo, hi], with `hi` inclusive only for
+  /// the rightmost path
+  static bool check_invariant(const Node &node, uint64_t lo, uint64_t hi,
+                              bool is_root, int level, int &leaf_level,
+                              uint64_t &count) {
+    uint32_t keys = node.leaf ? node.count : node.count - 1;
+    for (auto i = keys; i < node.keys.size(); i++) {
+      if (node.keys[i] != kEmptyKey) {
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < keys; i++) {
+      if (node.keys[i] < lo || node.keys[i] > hi ||
+          (i > 0 && node.keys[i - 1] >= node.keys[i])) {
+        return false;
+      }
+    }
+
+    if (node.leaf) {
+      if (node.count > kSlots || (!is_root && node.count < kMinKeys)) {
+        return false;
+      }
+      if (leaf_level == -1) {
+        leaf_level = level;
+      }
+      count += node.count;
+      return leaf_level == level;
+    }
+
+    const auto &inner = static_cast<const Inner &>(node);
+    auto min_children = is_root ? 2 : kMinChildren;
+    if (inner.count > kSlots + 1 || inner.count < min_children) {
+      return false;
+    }
+    for (uint32_t i = 0; i < inner.count; i++) {
+      auto child_lo = i == 0 ? lo : inner.keys[i - 1];
+      auto child_hi = i + 1 == inner.count ? hi : inner.keys[i] - 1;
+      if (!inner.children[i] ||
+          !check_invariant(*inner.children[i], child_lo, child_hi, false,
+                           level + 1, leaf_level, count)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Ptr root_;
+  uint64_t count_{};
+};
+
+inline void BTree::Node::destroy(Node *node) {
+  if (node->leaf) {
+    delete static_cast<Leaf *>(node);
+  } else {
+    delete static_cast<Inner *>(node);
+  }
+}
@@ -0,0 +1,483 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <utility>
+
+#include "intrusive-ptr.hh"
+
+/**
+ * HAMT is a persistent hash array mapped trie with the same snapshot
+ * semantics as RBTree: copying a map is O(1), and an update copies the nodes
+ * on the path from the root to the modified entry while sharing every other
+ * node with the older versions. It keeps no key order, in exchange a lookup
+ * in a map of 10M keys touches 5 nodes instead of ~25.
+ *
+ * Every node consumes 5 bits of the key hash and stores its entries and its
+ * children in two arrays sized exactly to their population, indexed by the
+ * popcount of a 32 bit bitmap (the CHAMP layout). Nodes are kept in canonical
+ * form, a subtree holding a single entry is always inlined into its parent,
+ * so the shape of a map depends only on its keys.
+ *
+ * A Transient applies a batch of updates to a private copy. Nodes it created
+ * itself are updated in place, so a batch only allocates the nodes whose
+ * population changes instead of copying the whole path on every update.
+ */
+class HAMT {
+  struct Node;
+  using Ptr = IntrusivePtr<Node>;
+
+public:
+  class Transient;
+
+  HAMT() = default;
+  HAMT(const HAMT &) = default;
+  HAMT &operator=(const HAMT &) = default;
+
+  HAMT(HAMT &&other) noexcept
+      : root_(std::move(other.root_)), count_(std::exchange(other.count_, 0)) {}
+
+  HAMT &operator=(HAMT &&other) noexcept {
+    root_ = std::move(other.root_);
+    count_ = std::exchange(other.count_, 0);
+    return *this;
+  }
+
+  void insert(uint64_t key, uint64_t value) {
+    bool inserted = false;
+    root_ = insert_into(root_, hash(key), key, value, 0, kFrozen, inserted);
+    if (inserted) {
+      count_++;
+    }
+  }
+
+  bool remove(uint64_t key) {
+    bool removed = false;
+    root_ = remove_from(root_, hash(key), key, 0, kFrozen, removed);
+    if (removed) {
+      count_--;
+    }
+    return removed;
+  }
+
+  std::optional<uint64_t> get(uint64_t key) const {
+    return find(root_, key);
+  }
+
+  bool contains(uint64_t key) const {
+    return get(key).has_value();
+  }
+
+  bool empty() const {
+    return count_ == 0;
+  }
+
+  uint64_t size() const {
+    return count_;
+  }
+
+  /// visit every entry, in hash order rather than key order
+  template <typename F>
+  void for_each(F &&f) const {
+    if (root_) {
+      for_each(*root_, f);
+    }
+  }
+
+  /// a private copy to apply a batch of updates to, see Transient
+  Transient transient() const;
+
+  bool is_valid() const {
+    uint64_t count = 0;
+    return (!root_ || check_invariant(*root_, 0, 0, true, count)) &&
+           count == count_;
+  }
+
+private:
+  static constexpr uint32_t kBits = 5;
+  static constexpr uint32_t kFanout = 1 << kBits;
+  // nodes built outside of a transient are never updated in place
+  static constexpr uint64_t kFrozen = 0;
+
+  /// a bijection, so distinct keys never collide and the trie is at most
+  /// 13 levels deep
+  static uint64_t hash(uint64_t key) {
+    // splitmix64 finalizer
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+    return key ^ (key >> 31);
+  }
+
+  static uint32_t bit_of(uint64_t hash, uint32_t shift) {
+    return uint32_t{1} << ((hash >> shift) & (kFanout - 1));
+  }
+
+  /// position of `bit` in the array indexed by `map`
+  static uint32_t index_of(uint32_t map, uint32_t bit) {
+    return std::popcount(map & (bit - 1));
+  }
+
+  struct Entry {
+    uint64_t key;
+    uint64_t value;
+  };
+
+  /**
+   * A node header followed by popcount(datamap) entries and then
+   * popcount(nodemap) children, allocated in one block of exactly that size.
+   */
+  struct Node {
+    std::atomic<uint32_t> refs_{0};
+    uint32_t datamap;
+    uint32_t nodemap;
+    // the transient allowed to update this node in place, or kFrozen
+    uint64_t owner;
+
+    Node(uint32_t datamap, uint32_t nodemap, uint64_t owner)
+        : datamap(datamap), nodemap(nodemap), owner(owner) {}
+
+    Node(const Node &) = delete;
+    Node &operator=(const Node &) = delete;
+
+    /// a node with value initialized entries and null children
+    static Ptr make(uint32_t datamap, uint32_t nodemap, uint64_t owner) {
+      auto entries = std::popcount(datamap);
+      auto children = std::popcount(nodemap);
+      void *block = ::operator new(sizeof(Node) + entries * sizeof(Entry) +
+                                   children * sizeof(Ptr));
+      auto *node = new (block) Node(datamap, nodemap, owner);
+      for (int i = 0; i < entries; i++) {
+        new (&node->entries()[i]) Entry{};
+      }
+      for (int i = 0; i < children; i++) {
+        new (&node->children()[i]) Ptr();
+      }
+      return Ptr(node);
+    }
+
+    static void destroy(Node *node) {
+      auto children = node->child_count();
+      for (uint32_t i = 0; i < children; i++) {
+        node->children()[i].~Ptr();
+      }
+      node->~Node();
+      ::operator delete(node);
+    }
+
+    uint32_t entry_count() const {
+      return std::popcount(datamap);
+    }
+
+    uint32_t child_count() const {
+      return std::popcount(nodemap);
+    }
+
+    Entry *entries() {
+      return reinterpret_cast<Entry *>(this + 1);
+    }
+
+    const Entry *entries() const {
+      return reinterpret_cast<const Entry *>(this + 1);
+    }
+
+    Ptr *children() {
+      return reinterpret_cast<Ptr *>(entries() + entry_count());
+    }
+
+    const Ptr *children() const {
+      return reinterpret_cast<const Ptr *>(entries() + entry_count());
+    }
+
+    bool editable_by(uint64_t transient) const {
+      return transient != kFrozen && owner == transient;
+    }
+  };
+
+  static_assert(sizeof(Node) % alignof(Entry) == 0 &&
+                    sizeof(Entry) % alignof(Ptr) == 0,
+                "the arrays follow the header without padding");
+
+  static std::optional<uint64_t> find(const Ptr &root, uint64_t key) {
+    const auto *node = root.get();
+    auto h = hash(key);
+    for (uint32_t shift = 0; node; shift += kBits) {
+      auto bit = bit_of(h, shift);
+      if (node->datamap & bit) {
+        const auto &entry = node->entries()[index_of(node->datamap, bit)];
+        if (entry.key == key) {
+          return entry.value;
+        }
+        return std::nullopt;
+      }
+      if (!(node->nodemap & bit)) {
+        return std::nullopt;
+      }
+      node = node->children()[index_of(node->nodemap, bit)].get();
+    }
+    return std::nullopt;
+  }
+
+  /// a copy of `node` owned by `owner`, with `bit` moved between the entries
+  /// and the children as given by the new maps; the slot of `bit` is left
+  /// empty in the copy
+  static Ptr reshape(const Node &node, uint32_t datamap, uint32_t nodemap,
+                     uint32_t bit, uint64_t owner) {
+    auto copy = Node::make(datamap, nodemap, owner);
+    auto *entries = copy->entries();
+    for (auto map = node.datamap & ~bit; map; map &= map - 1) {
+      auto b = map & -map;
+      entries[index_of(datamap, b)] =
+          node.entries()[index_of(node.datamap, b)];
+    }
+    auto *children = copy->children();
+    for (auto map = node.nodemap & ~bit; map; map &= map - 1) {
+      auto b = map & -map;
+      children[index_of(nodemap, b)] =
+          node.children()[index_of(node.nodemap, b)];
+    }
+    return copy;
+  }
+
+  /// `node` itself when the transient `owner` may update it in place,
+  /// otherwise a copy owned by `owner`
+  static Ptr editable(const Ptr &node, uint64_t owner) {
+    if (node->editable_by(owner)) {
+      return node;
+    }
+    return reshape(*node, node->datamap, node->nodemap, 0, owner);
+  }
+
+  /// the subtree holding two entries whose hashes first differ at `shift`
+  /// or below
+  static Ptr merge(const Entry &a, uint64_t a_hash, const Entry &b,
+                   uint64_t b_hash, uint32_t shift, uint64_t owner) {
+    auto a_bit = bit_of(a_hash, shift);
+    auto b_bit = bit_of(b_hash, shift);
+    if (a_bit == b_bit) {
+      assert(shift + kBits < 64);
+      auto node = Node::make(0, a_bit, owner);
+      node->children()[0] =
+          merge(a, a_hash, b, b_hash, shift + kBits, owner);
+      return node;
+    }
+    auto node = Node::make(a_bit | b_bit, 0, owner);
+    node->entries()[index_of(a_bit | b_bit, a_bit)] = a;
+    node->entries()[index_of(a_bit | b_bit, b_bit)] = b;
+    return node;
+  }
+
+  static Ptr insert_into(const Ptr &node, uint64_t h, uint64_t key,
+                         uint64_t value, uint32_t shift, uint64_t owner,
+                         bool &inserted) {
+    if (!node) {
+      auto bit = bit_of(h, shift);
+      auto root = Node::make(bit, 0, owner);
+      root->entries()[0] = {key, value};
+      inserted = true;
+      return root;
+    }
+
+    auto bit = bit_of(h, shift);
+    if (node->datamap & bit) {
+      auto idx = index_of(node->datamap, bit);
+      const auto existing = node->entries()[idx];
+      if (existing.key == key) {
+        if (existing.value == value) {
+          return node;
+        }
+        auto copy = editable(node, owner);
+        copy->entries()[idx].value = value;
+        return copy;
+      }
+      // two keys share this slot, push both one level down
+      auto copy = reshape(*node, node->datamap & ~bit, node->nodemap | bit,
+                          bit, owner);
+      copy->children()[index_of(copy->nodemap, bit)] =
+          merge(existing, hash(existing.key), {key, value}, h, shift + kBits,
+                owner);
+      inserted = true;
+      return copy;
+    }
+
+    if (node->nodemap & bit) {
+      auto idx = index_of(node->nodemap, bit);
+      const auto &child = node->children()[idx];
+      auto new_child =
+          insert_into(child, h, key, value, shift + kBits, owner, inserted);
+      if (new_child.get() == child.get()) {
+        return node;
+      }
+      auto copy = editable(node, owner);
+      copy->children()[idx] = std::move(new_child);
+      return copy;
+    }
+
+    auto copy =
+        reshape(*node, node->datamap | bit, node->nodemap, bit, owner);
+    copy->entries()[index_of(copy->datamap, bit)] = {key, value};
+    inserted = true;
+    return copy;
+  }
+
+  /// returns `node` itself if `key` is not in the subtree, and nullptr if
+  /// the subtree became empty
+  static Ptr remove_from(const Ptr &node, uint64_t h, uint64_t key,
+                         uint32_t shift, uint64_t owner, bool &removed) {
+    if (!node) {
+      return node;
+    }
+
+    auto bit = bit_of(h, shift);
+    if (node->datamap & bit) {
+      if (node->entries()[index_of(node->datamap, bit)].key != key) {
+        return node;
+      }
+      removed = true;
+      if (node->datamap == bit && node->nodemap == 0) {
+        return {};
+      }
+      return reshape(*node, node->datamap & ~bit, node->nodemap, bit, owner);
+    }
+
+    if (!(node->nodemap & bit)) {
+      return node;
+    }
+    auto idx = index_of(node->nodemap, bit);
+    const auto &child = node->children()[idx];
+    auto new_child = remove_from(child, h, key, shift + kBits, owner, removed);
+    if (new_child.get() == child.get()) {
+      return node;
+    }
+    // a non root node holds at least two entries, so the child is not empty
+    assert(new_child);
+    if (new_child->nodemap == 0 && new_child->entry_count() == 1) {
+      // keep the canonical form, inline the last entry of the child. The
+      // parent may now be a single entry itself, which its own parent inlines
+      auto copy = reshape(*node, node->datamap | bit, node->nodemap & ~bit,
+                          bit, owner);
+      copy->entries()[index_of(copy->datamap, bit)] = new_child->entries()[0];
+      return copy;
+    }
+    auto copy = editable(node, owner);
+    copy->children()[idx] = std::move(new_child);
+    return copy;
+  }
+
+  template <typename F>
+  static void for_each(const Node &node, F &f) {
+    for (uint32_t i = 0; i < node.entry_count(); i++) {
+      f(node.entries()[i].key, node.entries()[i].value);
+    }
+    for (uint32_t i = 0; i < node.child_count(); i++) {
+      for_each(*node.children()[i], f);
+    }
+  }
+
+  /// every key below `node` must hash to `prefix` in its lowest `shift` bits
+  static bool check_invariant(const Node &node, uint64_t prefix,
+                              uint32_t shift, bool is_root, uint64_t &count) {
+    if (node.refs_.load(std::memory_order_relaxed) == 0 ||
+        (node.datamap & node.nodemap) != 0) {
+      return false;
+    }
+    if (shift + kBits >= 64 && node.nodemap != 0) {
+      return false;
+    }
+    if (!is_root &&
+        (node.entry_count() + node.child_count() == 0 ||
+         (node.nodemap == 0 && node.entry_count() == 1))) {
+      return false;
+    }
+    auto mask = (uint64_t{1} << shift) - 1;
+    for (uint32_t i = 0; i < node.entry_count(); i++) {
+      auto h = hash(node.entries()[i].key);
+      if ((h & mask) != prefix) {
+        return false;
+      }
+      auto bit = bit_of(h, shift);
+      if (!(node.datamap & bit) || index_of(node.datamap, bit) != i) {
+        return false;
+      }
+    }
+    count += node.entry_count();
+    for (auto map = node.nodemap; map; map &= map - 1) {
+      auto bit = map & -map;
+      const auto &child = node.children()[index_of(node.nodemap, bit)];
+      auto child_prefix =
+          prefix | (uint64_t{static_cast<uint32_t>(std::countr_zero(bit))}
+                    << shift);
+      if (!child || !check_invariant(*child, child_prefix, shift + kBits,
+                                     false, count)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Ptr root_;
+  uint64_t count_{};
+};
+
+/**
+ * Updates applied to a private copy of a HAMT, which `persistent()` turns
+ * back into a snapshot. The HAMT the transient was made from is unaffected.
+ */
+class HAMT::Transient {
+public:
+  Transient(const Transient &) = delete;
+  Transient &operator=(const Transient &) = delete;
+  Transient(Transient &&) noexcept = default;
+  Transient &operator=(Transient &&) noexcept = default;
+
+  void insert(uint64_t key, uint64_t value) {
+    bool inserted = false;
+    map_.root_ =
+        insert_into(map_.root_, hash(key), key, value, 0, owner_, inserted);
+    if (inserted) {
+      map_.count_++;
+    }
+  }
+
+  bool remove(uint64_t key) {
+    bool removed = false;
+    map_.root_ = remove_from(map_.root_, hash(key), key, 0, owner_, removed);
+    if (removed) {
+      map_.count_--;
+    }
+    return removed;
+  }
+
+  std::optional<uint64_t> get(uint64_t key) const {
+    return map_.get(key);
+  }
+
+  uint64_t size() const {
+    return map_.size();
+  }
+
+  /// the updated map; the nodes keep the owner of this transient, which is
+  /// never handed out again, so no one updates them in place afterwards
+  HAMT persistent() && {
+    return std::move(map_);
+  }
+
+private:
+  friend class HAMT;
+
+  explicit Transient(HAMT map) : map_(std::move(map)) {
+    static std::atomic<uint64_t> next_owner{kFrozen + 1};
+    owner_ = next_owner.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  HAMT map_;
+  uint64_t owner_;
+};
+
+inline HAMT::Transient HAMT::transient() const {
+  return Transient(*this);
+}
@@ -1,32 +1,182 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include <tbb/parallel_invoke.h>
+
+#include "intrusive-ptr.hh"
+
+/**
+ * A monoid summarizes the entries of a subtree, every node caches the summary
+ * of its subtree so that range aggregates are answered in O(log n). `combine`
+ * must be associative and `identity()` its neutral element, commutativity is
+ * not required: summaries are always combined in key order.
+ */
+template <typename M>
+concept RBTreeMonoid = requires(uint64_t k, uint64_t v,
+                                const typename M::value_type &a) {
+  { M::identity() } -> std::convertible_to<typename M::value_type>;
+  { M::lift(k, v) } -> std::convertible_to<typename M::value_type>;
+  { M::combine(a, a) } -> std::convertible_to<typename M::value_type>;
+};
+
+/// no summary, takes no space in the nodes
+struct EmptyMonoid {
+  struct value_type {};
+  static value_type identity() {
+    return {};
+  }
+  static value_type lift(uint64_t /*key*/, uint64_t /*value*/) {
+    return {};
+  }
+  static value_type combine(value_type /*a*/, value_type /*b*/) {
+    return {};
+  }
+};
+
+struct SumMonoid {
+  using value_type = uint64_t;
+  static value_type identity() {
+    return 0;
+  }
+  static value_type lift(uint64_t /*key*/, uint64_t value) {
+    return value;
+  }
+  static value_type combine(value_type a, value_type b) {
+    return a + b;
+  }
+};
+
+struct MinMonoid {
+  using value_type = uint64_t;
+  static value_type identity() {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  static value_type lift(uint64_t /*key*/, uint64_t value) {
+    return value;
+  }
+  static value_type combine(value_type a, value_type b) {
+    return std::min(a, b);
+  }
+};
+
+struct MaxMonoid {
+  using value_type = uint64_t;
+  static value_type identity() {
+    return 0;
+  }
+  static value_type lift(uint64_t /*key*/, uint64_t value) {
+    return value;
+  }
+  static value_type combine(value_type a, value_type b) {
+    return std::max(a, b);
+  }
+};
+
+/**
+ * MerkleMonoid hashes the entries in key order. The hash only depends on the
+ * contents, not on the shape of the tree, so two versions or two replicas with
+ * different histories compare equal in O(1) through summary(), and can find
+ * their differences by descending into the key ranges whose hashes differ,
+ * see BasicRBTree::reconcile().
+ *
+ * The hash is a polynomial over the Mersenne prime 2^61 - 1 with a fixed
+ * base, which is good against accidental collisions but not adversarial ones.
+ */
+struct MerkleMonoid {
+  struct value_type {
+    uint64_t hash;
+    // kBase to the power of the number of entries
+    uint64_t shift;
+
+    bool operator==(const value_type &) const = default;
+  };
+
+  static constexpr uint64_t kPrime = (uint64_t{1} << 61) - 1;
+  static constexpr uint64_t kBase = 0x1f0e3b5c7a9d2461 % kPrime;
+
+  static value_type identity() {
+    return {0, 1};
+  }
+  static value_type lift(uint64_t key, uint64_t value) {
+    return {mix(mix(key) ^ value) % kPrime, kBase};
+  }
+  static value_type combine(value_type a, value_type b) {
+    return {add(mul(a.hash, b.shift), b.hash), mul(a.shift, b.shift)};
+  }
+
+private:
+  static uint64_t mix(uint64_t x) {
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+  static uint64_t add(uint64_t a, uint64_t b) {
+    auto r = a + b;
+    return r >= kPrime ? r - kPrime : r;
+  }
+  static uint64_t mul(uint64_t a, uint64_t b) {
+    auto p = static_cast<unsigned __int128>(a) * b;
+    return add(static_cast<uint64_t>(p) & kPrime,
+               static_cast<uint64_t>(p >> 61));
+  }
+};
+
+template <RBTreeMonoid Monoid>
+class BasicRBTreeLogWriter;
+
+template <RBTreeMonoid Monoid>
+class BasicRBTreeHistory;
 
 /// legend notion:
 /// X is black node, [Y] is red node, {Z} is double black node
 
-class RBTree {
+template <RBTreeMonoid Monoid = EmptyMonoid>
+class BasicRBTree {
+  friend class BasicRBTreeLogWriter<Monoid>;
+  friend class BasicRBTreeHistory<Monoid>;
+
 public:
+  using Summary = typename Monoid::value_type;
+
+  BasicRBTree() = default;
+
   void insert(uint64_t key, uint64_t value) {
     auto [new_root, inserted] = Node::insert_into(root_, key, value);
-    root_ = new_root;
+    root_ = std::move(new_root);
     if (inserted) {
       root_->color_ = Node::Color::Black;
-      count_++;
     }
   }
 
   bool remove(uint64_t key) {
     auto [new_root, removed] = Node::remove_from(root_, key);
-    root_ = new_root;
+    root_ = std::move(new_root);
     if (removed) {
-      root_->color_ = Node::Color::Black;
-      count_--;
+      if (!root_ || root_->is_double_black_nil()) {
+        // the last node was removed
+        root_ = nullptr;
+      } else {
+        root_->color_ = Node::Color::Black;
+      }
     }
     return removed;
   }
@@ -36,7 +186,150 @@ public:
   }
 
   bool empty() const {
-    return count_ == 0;
+    return !root_;
+  }
+
+  uint64_t size() const {
+    return Node::size(root_);
+  }
+
+  /// number of keys less than `key`
+  uint64_t rank(uint64_t key) const {
+    return Node::rank(root_, key, /*inclusive=*/false);
+  }
+
+  /// the `i`-th entry in key order, counting from zero
+  std::optional<std::pair<uint64_t, uint64_t>> select(uint64_t i) const {
+    return Node::select(root_, i);
+  }
+
+  /// number of keys in [lo, hi]
+  uint64_t count(uint64_t lo, uint64_t hi) const {
+    if (lo > hi) {
+      return 0;
+    }
+    return Node::rank(root_, hi, /*inclusive=*/true) -
+           Node::rank(root_, lo, /*inclusive=*/false);
+  }
+
+  /// summary of every entry in the tree
+  Summary summary() const {
+    return Node::summary(root_);
+  }
+
+  /// summary of the entries with keys in [lo, hi]
+  Summary aggregate(uint64_t lo, uint64_t hi) const {
+    if (lo > hi) {
+      return Monoid::identity();
+    }
+    return Node::aggregate(root_, lo, hi);
+  }
+
+  /// split the tree into the keys less than `key`, the value of `key` if it
+  /// is present, and the keys greater than `key`
+  std::tuple<BasicRBTree, std::optional<uint64_t>, BasicRBTree> split(
+      uint64_t key) const {
+    auto [left, value, right] = Node::split(root_, key);
+    return {BasicRBTree(std::move(left)), value,
+            BasicRBTree(std::move(right))};
+  }
+
+  /// every key of `left` must be less than `key`, and every key of `right`
+  /// must be greater than `key`
+  static BasicRBTree join(const BasicRBTree &left, uint64_t key,
+                          uint64_t value, const BasicRBTree &right) {
+    assert(!left.root_ || Node::max(left.root_)->weight_ < key);
+    assert(!right.root_ || Node::min(right.root_)->weight_ > key);
+    return BasicRBTree(Node::join(left.root_, key, value, right.root_));
+  }
+
+  /// keys of both trees, the value in `b` wins when a key is in both
+  static BasicRBTree set_union(const BasicRBTree &a, const BasicRBTree &b) {
+    return BasicRBTree(Node::set_union(a.root_, b.root_));
+  }
+
+  /// keys present in both trees with their values in `b`
+  static BasicRBTree set_intersection(const BasicRBTree &a,
+                                      const BasicRBTree &b) {
+    return BasicRBTree(Node::set_intersection(a.root_, b.root_));
+  }
+
+  /// keys of `a` that are not in `b`
+  static BasicRBTree set_difference(const BasicRBTree &a,
+                                    const BasicRBTree &b) {
+    return BasicRBTree(Node::set_difference(a.root_, b.root_));
+  }
+
+  /// an insert, or a removal when `value` is empty
+  struct Update {
+    uint64_t key;
+    std::optional<uint64_t> value;
+  };
+
+  /**
+   * apply `updates`, sorted by strictly increasing key
+   *
+   * The batch is partitioned by key down the tree and the copied paths are
+   * joined back bottom-up, so a node above several updated keys is copied
+   * once for the whole batch rather than once per update. Large partitions
+   * are applied in parallel.
+   */
+  void apply_batch(std::span<const Update> updates) {
+    assert(std::ranges::adjacent_find(updates, [](auto &a, auto &b) {
+             return a.key >= b.key;
+           }) == updates.end());
+    root_ = Node::blacken(
+        Node::apply_batch(root_, Node::black_height(root_), updates).root);
+  }
+
+  /// visit every entry in key order
+  template <typename F>
+  void for_each(F &&f) const {
+    Node::for_each(root_, f);
+  }
+
+  /// visit the entries with keys in [lo, hi] in key order
+  template <typename F>
+  void for_each(uint64_t lo, uint64_t hi, F &&f) const {
+    Node::for_each(root_, lo, hi, f);
+  }
+
+  /**
+   * report the differences between two versions of a tree
+   *
+   * `on_added(key, value)`, `on_removed(key, value)` and
+   * `on_changed(key, old_value, new_value)` are called in key order. Subtrees
+   * shared by both versions are skipped without being visited, so the cost is
+   * proportional to the number of nodes copied between the two versions.
+   */
+  template <typename Added, typename Removed, typename Changed>
+  static void diff(const BasicRBTree &old_tree, const BasicRBTree &new_tree,
+                   Added &&on_added, Removed &&on_removed,
+                   Changed &&on_changed) {
+    Node::diff(old_tree.root_, new_tree.root_, on_added, on_removed,
+               on_changed);
+  }
+
+  /// ranges holding at most this many keys on both sides are not bisected
+  static constexpr uint64_t kReconcileRange = 16;
+
+  /**
+   * report key ranges `on_range(lo, hi)` which cover every difference between
+   * `a` and `b`, in key order
+   *
+   * Unlike diff() the two trees need not share nodes: ranges are bisected at
+   * the median key wherever their aggregates differ, so this is only useful
+   * with a hashing monoid such as MerkleMonoid. Two replicas run the same
+   * descent remotely by exchanging count() and aggregate() of each range.
+   */
+  template <typename F>
+    requires std::equality_comparable<Summary>
+  static void reconcile(const BasicRBTree &a, const BasicRBTree &b,
+                        F &&on_range) {
+    if (a.root_ == b.root_) {
+      return;
+    }
+    reconcile_range(a, b, 0, std::numeric_limits<uint64_t>::max(), on_range);
   }
 
   bool is_valid() const {
@@ -50,9 +343,117 @@ public:
     Node::print_tree(root_, Node::Direction::Self, 0);
   }
 
+  struct Stats {
+    uint64_t nodes;
+    // bytes of the nodes themselves, allocator overhead not included
+    uint64_t bytes;
+    uint64_t height;
+    uint64_t black_height;
+
+    /// call `f(name, value)` for every counter
+    template <typename F>
+    void for_each_counter(F &&f) const {
+      f("nodes", nodes);
+      f("bytes", bytes);
+      f("height", height);
+      f("black_height", black_height);
+    }
+  };
+
+  /// shape of this version, O(n)
+  Stats stats() const {
+    uint64_t height = 0;
+    std::vector<std::pair<const Node *, uint64_t>> stack;
+    if (root_) {
+      stack.emplace_back(root_.get(), 1);
+    }
+    while (!stack.empty()) {
+      auto [node, depth] = stack.back();
+      stack.pop_back();
+      height = std::max(height, depth);
+      for (const auto *child :
+           {node->children_.left_.get(), node->children_.right_.get()}) {
+        if (child) {
+          stack.emplace_back(child, depth + 1);
+        }
+      }
+    }
+    return {.nodes = size(),
+            .bytes = size() * sizeof(Node),
+            .height = height,
+            .black_height =
+                static_cast<uint64_t>(Node::black_height(root_))};
+  }
+
+  struct SharingStats {
+    uint64_t versions;
+    // nodes summed over the versions, as if they shared nothing
+    uint64_t logical_nodes;
+    // distinct nodes, which is what the versions actually pin
+    uint64_t unique_nodes;
+    // distinct nodes reachable from more than one version
+    uint64_t shared_nodes;
+    uint64_t bytes;
+
+    /// call `f(name, value)` for every counter
+    template <typename F>
+    void for_each_counter(F &&f) const {
+      f("versions", versions);
+      f("logical_nodes", logical_nodes);
+      f("unique_nodes", unique_nodes);
+      f("shared_nodes", shared_nodes);
+      f("bytes", bytes);
+    }
+  };
+
+  /// how much the `versions` share, O(number of distinct nodes)
+  static SharingStats sharing(std::span<const BasicRBTree> versions) {
+    // the first version reaching a node, or kShared once a second one does.
+    // Each node is walked at most twice: when first reached, and when it
+    // turns out to be shared, which makes its whole subtree shared.
+    constexpr auto kShared = std::numeric_limits<size_t>::max();
+    std::unordered_map<const Node *, size_t> owner;
+    uint64_t logical_nodes = 0;
+    uint64_t shared_nodes = 0;
+    std::vector<const Node *> stack;
+    for (size_t v = 0; v < versions.size(); v++) {
+      logical_nodes += versions[v].size();
+      if (versions[v].root_) {
+        stack.push_back(versions[v].root_.get());
+      }
+      while (!stack.empty()) {
+        const auto *node = stack.back();
+        stack.pop_back();
+        auto [it, inserted] = owner.try_emplace(node, v);
+        if (!inserted) {
+          if (it->second == kShared || it->second == v) {
+            continue;
+          }
+          it->second = kShared;
+          shared_nodes++;
+        }
+        for (const auto *child :
+             {node->children_.left_.get(), node->children_.right_.get()}) {
+          if (child) {
+            stack.push_back(child);
+          }
+        }
+      }
+    }
+    return {.versions = versions.size(),
+            .logical_nodes = logical_nodes,
+            .unique_nodes = owner.size(),
+            .shared_nodes = shared_nodes,
+            .bytes = owner.size() * sizeof(Node)};
+  }
+
 private:
-  struct Node : std::enable_shared_from_this<Node> {
-    using Ptr = std::shared_ptr<Node>;
+  struct Node;
+
+  using NodePtr = IntrusivePtr<Node>;
+
+  struct Node {
+    using Ptr = NodePtr;
 
     enum class Color : uint8_t {
       Red,
@@ -68,18 +469,46 @@ private:
     };
 
     Node(Ptr left, Ptr right, uint64_t weight, uint64_t value, Color color)
-        : children_{.left_ = std::move(left), .right_ = std::move(right)},
+        : color_(color),
+          children_{.left_ = std::move(left), .right_ = std::move(right)},
           weight_(weight),
           value_(value),
-          color_(color) {}
-
+          size_(color == Color::DoubleBlackNil
+                    ? 0
+                    : 1 + size(children_.left_) + size(children_.right_)),
+          summary_(color == Color::DoubleBlackNil
+                       ? Monoid::identity()
+                       : Monoid::combine(
+                             Monoid::combine(summary(children_.left_),
+                                             Monoid::lift(weight, value)),
+                             summary(children_.right_))) {}
+
+    Node(const Node &) = delete;
+    Node &operator=(const Node &) = delete;
+
+    // the color fills the padding after the reference count, which keeps an
+    // EmptyMonoid node at 48 bytes
+    std::atomic<uint32_t> refs_{0};
+    Color color_;
     struct Children {
       Ptr left_;
       Ptr right_;
     } children_{};
     uint64_t weight_;
     uint64_t value_;
-    Color color_;
+    // number of nodes in the subtree, kept by every constructor so that path
+    // copying maintains it for free
+    uint64_t size_;
+    // likewise for the monoid summary of the subtree
+    [[no_unique_address]] Summary summary_;
+
+    static uint64_t size(const Ptr &node) {
+      return node ? node->size_ : 0;
+    }
+
+    static Summary summary(const Ptr &node) {
+      return node ? node->summary_ : Monoid::identity();
+    }
 
     static std::pair<Ptr, Ptr> children(const Ptr &node) {
       if (!node || node->color_ == Color::DoubleBlackNil) {
@@ -176,34 +605,34 @@ private:
     }
 
     Ptr dup_with_left(Ptr new_left) const {
-      return std::make_shared<Node>(std::move(new_left), children_.right_,
-                                    weight_, value_, color_);
+      return Ptr::make(std::move(new_left), children_.right_, weight_, value_,
+                       color_);
     }
 
     Ptr dup_with_right(Ptr new_right) const {
-      return std::make_shared<Node>(children_.left_, std::move(new_right),
-                                    weight_, value_, color_);
+      return Ptr::make(children_.left_, std::move(new_right), weight_, value_,
+                       color_);
     }
 
     Ptr dup_with_child(Ptr new_left, Ptr new_right) const {
-      return std::make_shared<Node>(std::move(new_left), std::move(new_right),
-                                    weight_, value_, color_);
+      return Ptr::make(std::move(new_left), std::move(new_right), weight_,
+                       value_, color_);
     }
 
     Ptr dup_with_child_and_color(Ptr new_left, Ptr new_right,
                                  Color color) const {
-      return std::make_shared<Node>(std::move(new_left), std::move(new_right),
-                                    weight_, value_, color);
+      return Ptr::make(std::move(new_left), std::move(new_right), weight_,
+                       value_, color);
     }
 
     Ptr dup_with_color(Color color) const {
-      return std::make_shared<Node>(children_.left_, children_.right_, weight_,
-                                    value_, color);
+      return Ptr::make(children_.left_, children_.right_, weight_, value_,
+                       color);
     }
 
     Ptr dup_with_value(uint64_t value) const {
-      return std::make_shared<Node>(children_.left_, children_.right_, weight_,
-                                    value, color_);
+      return Ptr::make(children_.left_, children_.right_, weight_, value,
+                       color_);
     }
 
     Ptr to_single_black() {
@@ -217,24 +646,67 @@ private:
       }
       assert(color_ == Color::DoubleBlack);
       color_ = Color::Black;
-      return shared_from_this();
+      return Ptr(this);
     }
 
     static Ptr new_leaf(uint64_t key, uint64_t value, Color c = Color::Red) {
-      return std::make_shared<Node>(nullptr, nullptr, key, value, c);
+      return Ptr::make(nullptr, nullptr, key, value, c);
     }
 
-    static std::optional<uint64_t> get(const Ptr &node, uint64_t key) {
-      if (!node) {
-        return std::nullopt;
+    static const Ptr &double_black_nil() {
+      // never mutated, to_single_black() just drops it. Both the node and the
+      // reference live in static storage and are never destroyed, so the
+      // count cannot drop to zero even while trees are torn down at exit.
+      alignas(Node) static std::byte node[sizeof(Node)];
+      alignas(Ptr) static std::byte ptr[sizeof(Ptr)];
+      static const Ptr *nil = new (ptr) Ptr(
+          new (node) Node(nullptr, nullptr, 0, 0, Color::DoubleBlackNil));
+      return *nil;
+    }
+
+    /**
+     * Search path recorded by the iterative updates, from the root down.
+     * A red-black tree of 2^64 nodes is at most 128 levels deep, so a fixed
+     * array is enough and the stack frames are left uninitialized.
+     */
+    struct Path {
+      static constexpr int kMaxDepth = 128;
+
+      std::array<const Node *, kMaxDepth> nodes_;
+      std::array<bool, kMaxDepth> right_;
+      int depth_ = 0;
+
+      void push(const Node *node, bool right) {
+        assert(depth_ < kMaxDepth);
+        nodes_[depth_] = node;
+        right_[depth_] = right;
+        depth_++;
       }
-      if (node->weight_ == key) {
-        return node->value_;
+
+      /// copy the recorded path bottom-up on top of `node`, applying `fix` to
+      /// every copied ancestor
+      template <typename F>
+      Ptr rebuild(Ptr node, F &&fix) {
+        while (depth_ > 0) {
+          depth_--;
+          const auto *parent = nodes_[depth_];
+          node = fix(right_[depth_] ? parent->dup_with_right(std::move(node))
+                                    : parent->dup_with_left(std::move(node)));
+        }
+        return node;
       }
-      if (node->weight_ < key) {
-        return get(node->children_.right_, key);
+    };
+
+    static std::optional<uint64_t> get(const Ptr &root, uint64_t key) {
+      const auto *node = root.get();
+      while (node) {
+        if (node->weight_ == key) {
+          return node->value_;
+        }
+        node = node->weight_ < key ? node->children_.right_.get()
+                                   : node->children_.left_.get();
       }
-      return get(node->children_.left_, key);
+      return std::nullopt;
     }
 
     static Ptr balance(Ptr node) {  // NOLINT
@@ -375,7 +847,7 @@ private:
           auto [a, Y] = children(Z);
           auto [X, d] = children(Y);
           auto [b, c] = children(X);
-          assert(!d->is_red());
+          assert(Y->is_black(Direction::Right));
           return X->dup_with_child_and_color(
               Z->dup_with_child_and_color(a, b, Color::Black),
               Y->dup_with_child_and_color(c, d, Color::Black), Color::Black);
@@ -386,21 +858,25 @@ private:
       return node;
     }
 
-    static std::pair<Ptr, bool> insert_into(Ptr &node, uint64_t key,
+    static std::pair<Ptr, bool> insert_into(const Ptr &root, uint64_t key,
                                             uint64_t value) {
-      if (!node) {
-        return {new_leaf(key, value), true};
-      }
-      if (node->weight_ == key) {
-        return {node->dup_with_value(value), false};
+      Path path;
+      const auto *node = root.get();
+      while (node && node->weight_ != key) {
+        auto right = node->weight_ < key;
+        path.push(node, right);
+        node = right ? node->children_.right_.get()
+                     : node->children_.left_.get();
       }
-      auto [left, right] = children(node);
-      if (node->weight_ < key) {
-        auto [new_right, inserted] = insert_into(right, key, value);
-        return {balance(node->dup_with_right(std::move(new_right))), inserted};
+      if (node) {
+        // the shape is unchanged, nothing to rebalance
+        return {path.rebuild(node->dup_with_value(value),
+                             [](Ptr n) { return n; }),
+                false};
       }
-      auto [new_left, inserted] = insert_into(left, key, value);
-      return {balance(node->dup_with_left(std::move(new_left))), inserted};
+      return {path.rebuild(new_leaf(key, value),
+                           [](Ptr n) { return balance(std::move(n)); }),
+              true};
     }
 
     static Ptr rotate(const Ptr &node) {
@@ -541,156 +1017,689 @@ private:
       Ptr node;
     };
 
-    static MinimalDeleteResult minimal_delete(const Ptr &node) {
-      assert(node);
-      static Ptr double_nil = new_leaf(0, 0, Color::DoubleBlackNil);
+    static MinimalDeleteResult minimal_delete(const Ptr &root) {
+      assert(root);
+      Path path;
+      const auto *node = root.get();
+      while (node->children_.left_) {
+        path.push(node, false);
+        node = node->children_.left_.get();
+      }
 
+      Ptr rest;
       if (node->no_children()) {
-        if (node->is_red()) {
-          return MinimalDeleteResult(node->weight_, node->value_, nullptr);
-        }
-        if (node->is_black()) {
-          return MinimalDeleteResult(node->weight_, node->value_, double_nil);
-        }
-      }
-      if (node->single_child() && node->children_.right_) {
+        rest = node->is_red() ? nullptr : double_black_nil();
+      } else {
         assert(node->is_black());
         assert(node->children_.right_->is_red());
-        return MinimalDeleteResult(
-            node->weight_, node->value_,
-            node->children_.right_->dup_with_color(Color::Red));
+        rest = node->children_.right_->dup_with_color(Color::Black);
       }
-      assert(node->children_.left_);
-      auto res = minimal_delete(node->children_.left_);
-      res.node = rotate(node->dup_with_left(res.node));
-      return res;
+      return MinimalDeleteResult(
+          node->weight_, node->value_,
+          path.rebuild(std::move(rest),
+                       [](Ptr n) { return rotate(std::move(n)); }));
     }
 
-    static std::pair<Ptr, bool> remove_from(Ptr &node, uint64_t key) {
-      if (!node) {
-        return {nullptr, false};
+    /// the subtree left after removing `node` itself
+    static Ptr remove_node(const Node &node) {
+      /**
+       * red node without children
+       *
+       *     [N]                |
+       *     / \     ===>  nil  |
+       *    /   \               |
+       *   nil  nil             |
+       */
+      if (node.is_red() && node.no_children()) {
+        return nullptr;
       }
 
-      if (key == node->weight_) {
+      if (node.is_black() && node.single_child()) {
         /**
-         * red node without children
+         * black node with single red child
          *
-         *     [N]                |
-         *     / \     ===>  nil  |
-         *    /   \               |
-         *   nil  nil             |
+         *      P                    |
+         *     / \                   |
+         *   [C] nil                 |
+         *                     C     |
+         *      or    ===>    / \    |
+         *                  nil nil  |
+         *      P                    |
+         *     / \                   |
+         *   nil [C]                 |
          */
-        if (node->is_red() && node->no_children()) {
-          return {nullptr, true};
+        if (node.is_red(Direction::Left)) {
+          return node.children_.left_->dup_with_color(Color::Black);
         }
-
-        if (node->is_black() && node->single_child()) {
-          /**
-           * black node with single red child
-           *
-           *      P                    |
-           *     / \                   |
-           *   [C] nil                 |
-           *                     C     |
-           *      or    ===>    / \    |
-           *                  nil nil  |
-           *      P                    |
-           *     / \                   |
-           *   nil [C]                 |
-           */
-          if (node->is_red(Direction::Left)) {
-            return {node->children_.left_->dup_with_color(Color::Black), true};
-          }
-          if (node->is_red(Direction::Right)) {
-            return {node->children_.right_->dup_with_color(Color::Black), true};
-          }
+        if (node.is_red(Direction::Right)) {
+          return node.children_.right_->dup_with_color(Color::Black);
         }
+      }
 
-        if (node->is_black() && node->no_children()) {
-          // single black node, return a double black node
-          return {new_leaf(0, 0, Color::DoubleBlackNil), true};
-        }
-        // fallback to recursive procedure
+      if (node.is_black() && node.no_children()) {
+        // single black node, return a double black node
+        return double_black_nil();
       }
 
-      if (node->weight_ < key) {
-        auto [new_right, removed] = remove_from(node->children_.right_, key);
-        if (removed) {
-          return {rotate(node->dup_with_right(new_right)), true};
-        }
-        return {node, false};
+      // replace the node with its minimal successor
+      auto res = minimal_delete(node.children_.right_);
+      return rotate(Ptr::make(node.children_.left_, std::move(res.node),
+                              res.key, res.value, node.color_));
+    }
+
+    static std::pair<Ptr, bool> remove_from(const Ptr &root, uint64_t key) {
+      Path path;
+      const auto *node = root.get();
+      while (node && node->weight_ != key) {
+        auto right = node->weight_ < key;
+        path.push(node, right);
+        node = right ? node->children_.right_.get()
+                     : node->children_.left_.get();
+      }
+      if (!node) {
+        return {root, false};
       }
-      if (node->weight_ > key) {
-        auto res = remove_from(node->children_.left_, key);
-        auto &[new_left, removed] = res;
-        if (removed) {
-          return {rotate(node->dup_with_left(new_left)), true};
+      return {path.rebuild(remove_node(*node),
+                           [](Ptr n) { return rotate(std::move(n)); }),
+              true};
+    }
+
+    static uint64_t rank(const Ptr &root, uint64_t key, bool inclusive) {
+      uint64_t rank = 0;
+      const auto *node = root.get();
+      while (node) {
+        const auto &[left, right] = node->children_;
+        if (node->weight_ < key || (inclusive && node->weight_ == key)) {
+          rank += size(left) + 1;
+          node = right.get();
+        } else {
+          node = left.get();
         }
-        return {node, false};
       }
+      return rank;
+    }
 
-      // node->weight_ == key, find the minimal successor
+    /// summary of the keys in the subtree that are not less than `lo`
+    static Summary suffix(const Ptr &root, uint64_t lo) {
+      auto acc = Monoid::identity();
+      const auto *node = root.get();
+      while (node) {
+        const auto &[left, right] = node->children_;
+        if (node->weight_ >= lo) {
+          acc = Monoid::combine(
+              Monoid::combine(Monoid::lift(node->weight_, node->value_),
+                              summary(right)),
+              acc);
+          node = left.get();
+        } else {
+          node = right.get();
+        }
+      }
+      return acc;
+    }
 
-      auto res = minimal_delete(node->children_.right_);
-      auto new_node = node->dup_with_right(res.node);
-      new_node->weight_ = res.key;
-      new_node->value_ = res.value;
-      return {rotate(new_node), true};
+    /// summary of the keys in the subtree that are not greater than `hi`
+    static Summary prefix(const Ptr &root, uint64_t hi) {
+      auto acc = Monoid::identity();
+      const auto *node = root.get();
+      while (node) {
+        const auto &[left, right] = node->children_;
+        if (node->weight_ <= hi) {
+          acc = Monoid::combine(
+              acc, Monoid::combine(summary(left),
+                                   Monoid::lift(node->weight_, node->value_)));
+          node = right.get();
+        } else {
+          node = left.get();
+        }
+      }
+      return acc;
     }
 
-    static bool check_invariant(const Ptr &node) {
+    static Summary aggregate(const Ptr &root, uint64_t lo, uint64_t hi) {
+      // find the topmost node inside the range, the range is then covered by
+      // a suffix of its left subtree, itself, and a prefix of its right one
+      const auto *node = root.get();
+      while (node && (node->weight_ < lo || node->weight_ > hi)) {
+        node = node->weight_ < lo ? node->children_.right_.get()
+                                  : node->children_.left_.get();
+      }
       if (!node) {
-        return true;
+        return Monoid::identity();
       }
+      return Monoid::combine(
+          Monoid::combine(suffix(node->children_.left_, lo),
+                          Monoid::lift(node->weight_, node->value_)),
+          prefix(node->children_.right_, hi));
+    }
 
-      if (node->is_red()) {
-        if (node->is_red(Direction::Left)) {
-          return false;
+    static std::optional<std::pair<uint64_t, uint64_t>> select(const Ptr &root,
+                                                               uint64_t i) {
+      const auto *node = root.get();
+      while (node) {
+        const auto &[left, right] = node->children_;
+        auto left_size = size(left);
+        if (i == left_size) {
+          return std::make_pair(node->weight_, node->value_);
         }
-        if (node->is_red(Direction::Right)) {
-          return false;
+        if (i < left_size) {
+          node = left.get();
+        } else {
+          i -= left_size + 1;
+          node = right.get();
         }
       }
+      return std::nullopt;
+    }
+
+    static const Node *min(const Ptr &node) {
+      auto *n = node.get();
+      while (n->children_.left_) {
+        n = n->children_.left_.get();
+      }
+      return n;
+    }
+
+    static const Node *max(const Ptr &node) {
+      auto *n = node.get();
+      while (n->children_.right_) {
+        n = n->children_.right_.get();
+      }
+      return n;
+    }
+
+    static Ptr blacken(Ptr node) {
+      if (node && node->is_red()) {
+        return node->dup_with_color(Color::Black);
+      }
+      return node;
+    }
+
+    static int black_height(const Ptr &node) {
+      int height = 0;
+      for (auto *n = node.get(); n; n = n->children_.left_.get()) {
+        height += n->is_black() ? 1 : 0;
+      }
+      return height;
+    }
+
+    /**
+     * join_right descends the right spine of `node` to the first black node
+     * whose black height equals the one of `right`, and replaces it with a red
+     * node holding the middle entry:
+     *
+     *     ...                    ...          |
+     *       \                       \         |
+     *        C       =====>         [K]       |
+     *                               / \       |
+     *                              C  right   |
+     *
+     * red-red violations are repaired by `balance` on the way up.
+     */
+    static Ptr join_right(const Ptr &node, int height, uint64_t key,
+                          uint64_t value, Ptr right, int right_height) {
+      if (!node || (node->is_black() && height == right_height)) {
+        assert(height == right_height);
+        return Ptr::make(node, std::move(right), key, value, Color::Red);
+      }
+      auto child_height = height - (node->is_black() ? 1 : 0);
+      auto new_right = join_right(node->children_.right_, child_height, key,
+                                  value, std::move(right), right_height);
+      return balance(node->dup_with_right(std::move(new_right)));
+    }
+
+    static Ptr join_left(Ptr left, int left_height, uint64_t key,
+                         uint64_t value, const Ptr &node, int height) {
+      if (!node || (node->is_black() && height == left_height)) {
+        assert(height == left_height);
+        return Ptr::make(std::move(left), node, key, value, Color::Red);
+      }
+      auto child_height = height - (node->is_black() ? 1 : 0);
+      auto new_left = join_left(std::move(left), left_height, key, value,
+                                node->children_.left_, child_height);
+      return balance(node->dup_with_left(std::move(new_left)));
+    }
+
+    static Ptr join(Ptr left, uint64_t key, uint64_t value, Ptr right) {
+      auto left_height = black_height(left);
+      auto right_height = black_height(right);
+      return join(std::move(left), left_height, key, value, std::move(right),
+                  right_height)
+          .root;
+    }
+
+    /// a subtree along with its black height
+    struct Joined {
+      Ptr root;
+      int black_height;
+    };
+
+    /// join for callers that already know the black heights of both sides
+    static Joined join(Ptr left, int left_height, uint64_t key,
+                       uint64_t value, Ptr right, int right_height) {
+      if (left && left->is_red()) {
+        left = blacken(std::move(left));
+        left_height++;
+      }
+      if (right && right->is_red()) {
+        right = blacken(std::move(right));
+        right_height++;
+      }
+
+      Ptr root;
+      if (left_height > right_height) {
+        root = join_right(left, left_height, key, value, std::move(right),
+                          right_height);
+      } else if (left_height < right_height) {
+        root = join_left(std::move(left), left_height, key, value, right,
+                         right_height);
+      } else {
+        return {Ptr::make(std::move(left), std::move(right), key, value,
+                          Color::Black),
+                left_height + 1};
+      }
+      // a red root left by balance gains a black level once blackened
+      auto height =
+          std::max(left_height, right_height) + (root->is_red() ? 1 : 0);
+      // the root is freshly copied by join_right/join_left
+      root->color_ = Color::Black;
+      return {std::move(root), height};
+    }
+
+    /// join two trees without a middle entry
+    static Ptr join2(Ptr left, const Ptr &right) {
+      if (!right) {
+        return left;
+      }
+      auto *m = min(right);
+      auto res = split(right, m->weight_);
+      return join(std::move(left), m->weight_, m->value_, std::move(res.right));
+    }
+
+    struct SplitResult {
+      Ptr left;
+      std::optional<uint64_t> value;
+      Ptr right;
+    };
 
+    static SplitResult split(const Ptr &node, uint64_t key) {
+      if (!node) {
+        return {};
+      }
       auto [left, right] = children(node);
+      if (key == node->weight_) {
+        return {std::move(left), node->value_, std::move(right)};
+      }
+      if (key < node->weight_) {
+        auto res = split(left, key);
+        res.right =
+            join(std::move(res.right), node->weight_, node->value_, right);
+        return res;
+      }
+      auto res = split(right, key);
+      res.left = join(left, node->weight_, node->value_, std::move(res.left));
+      return res;
+    }
+
+    // subproblems smaller than this are not worth a task
+    static constexpr uint64_t kParallelCutoff = 4096;
 
-      if (!check_invariant(left)) {
-        return false;
+    template <typename F, typename G>
+    static void fork(uint64_t work, F &&f, G &&g) {
+      if (work > kParallelCutoff) {
+        tbb::parallel_invoke(std::forward<F>(f), std::forward<G>(g));
+      } else {
+        f();
+        g();
       }
+    }
+
+    static Ptr set_union(const Ptr &a, const Ptr &b) {
+      if (!a) {
+        return b;
+      }
+      if (!b) {
+        return a;
+      }
+      auto [left, right] = children(a);
+      auto res = split(b, a->weight_);
+      Ptr new_left;
+      Ptr new_right;
+      fork(
+          size(a) + size(b),
+          [&] { new_left = set_union(left, res.left); },
+          [&] { new_right = set_union(right, res.right); });
+      return join(std::move(new_left), a->weight_,
+                  res.value.value_or(a->value_), std::move(new_right));
+    }
+
+    static Ptr set_intersection(const Ptr &a, const Ptr &b) {
+      if (!a || !b) {
+        return nullptr;
+      }
+      auto [left, right] = children(a);
+      auto res = split(b, a->weight_);
+      Ptr new_left;
+      Ptr new_right;
+      fork(
+          size(a) + size(b),
+          [&] { new_left = set_intersection(left, res.left); },
+          [&] { new_right = set_intersection(right, res.right); });
+      if (res.value) {
+        return join(std::move(new_left), a->weight_, *res.value,
+                    std::move(new_right));
+      }
+      return join2(std::move(new_left), new_right);
+    }
+
+    static Ptr set_difference(const Ptr &a, const Ptr &b) {
+      if (!a || !b) {
+        return a;
+      }
+      auto [left, right] = children(b);
+      auto res = split(a, b->weight_);
+      Ptr new_left;
+      Ptr new_right;
+      fork(
+          size(a) + size(b),
+          [&] { new_left = set_difference(res.left, left); },
+          [&] { new_right = set_difference(res.right, right); });
+      return join2(std::move(new_left), new_right);
+    }
 
-      if (!check_invariant(right)) {
-        return false;
+    /// `height` is the black height of `node`, the one of the result is
+    /// returned with it so that no level walks a spine to find it
+    static Joined apply_batch(const Ptr &node, int height,
+                              std::span<const Update> updates) {
+      if (updates.empty()) {
+        return {node, height};
       }
 
-      int left_black_height = get_black_height(left);
-      int right_black_height = get_black_height(right);
+      // below a leaf the inserts of the batch build a balanced subtree
+      auto mid = updates.size() / 2;
+      auto key = updates[mid].key;
+      auto value = updates[mid].value;
+      size_t skip = 1;
+      Ptr left;
+      Ptr right;
+      int child_height = 0;
+      if (node) {
+        key = node->weight_;
+        std::tie(left, right) = children(node);
+        child_height = height - (node->is_black() ? 1 : 0);
+        mid = std::ranges::lower_bound(updates, key, {}, &Update::key) -
+              updates.begin();
+        auto found = mid < updates.size() && updates[mid].key == key;
+        value = found ? updates[mid].value : node->value_;
+        skip = found ? 1 : 0;
+      }
 
-      return left_black_height == right_black_height;
+      Joined new_left;
+      Joined new_right;
+      fork(
+          updates.size(),
+          [&] {
+            new_left = apply_batch(left, child_height, updates.first(mid));
+          },
+          [&] {
+            new_right = apply_batch(right, child_height,
+                                    updates.subspan(mid + skip));
+          });
+      if (!value) {
+        // removing a key already walks the right side in join2
+        auto root = join2(std::move(new_left.root), new_right.root);
+        return {root, black_height(root)};
+      }
+      if (node && new_left.black_height == child_height &&
+          new_right.black_height == child_height &&
+          (node->is_black() ||
+           ((!new_left.root || new_left.root->is_black()) &&
+            (!new_right.root || new_right.root->is_black())))) {
+        // the children kept their black heights, copy the node as it is
+        return {Ptr::make(std::move(new_left.root), std::move(new_right.root),
+                          key, *value, node->color_),
+                height};
+      }
+      return join(std::move(new_left.root), new_left.black_height, key,
+                  *value, std::move(new_right.root), new_right.black_height);
     }
 
-    static int get_black_height(const Ptr &node) {
+    template <typename F>
+    static void for_each(const Ptr &node, F &f) {
       if (!node) {
-        return 1;
+        return;
       }
+      for_each(node->children_.left_, f);
+      f(node->weight_, node->value_);
+      for_each(node->children_.right_, f);
+    }
 
-      auto [left, right] = children(node);
+    template <typename F>
+    static void for_each(const Ptr &node, uint64_t lo, uint64_t hi, F &f) {
+      if (!node) {
+        return;
+      }
+      if (lo < node->weight_) {
+        for_each(node->children_.left_, lo, hi, f);
+      }
+      if (lo <= node->weight_ && node->weight_ <= hi) {
+        f(node->weight_, node->value_);
+      }
+      if (node->weight_ < hi) {
+        for_each(node->children_.right_, lo, hi, f);
+      }
+    }
+
+    /**
+     * DiffCursor walks a tree in key order as a stack of pending items, each
+     * item is either a whole unvisited subtree or a single node whose left
+     * subtree has been consumed. Keeping subtrees unexpanded until needed lets
+     * `diff` compare them by pointer. A left child starts where its parent
+     * does, the smallest key of a right child is only looked up, down its
+     * left spine, when `diff` needs it.
+     */
+    class DiffCursor {
+    public:
+      explicit DiffCursor(const Ptr &root) {
+        if (root) {
+          stack_.push_back({root.get(), 0, false, true});
+        }
+      }
+
+      struct Item {
+        const Node *node;
+        uint64_t min_key;  // valid if min_known
+        bool min_known;
+        bool subtree;
+      };
+
+      bool empty() const {
+        return stack_.empty();
+      }
+
+      const Item &top() const {
+        return stack_.back();
+      }
+
+      /// smallest key of the top item
+      uint64_t min_key() {
+        auto &item = stack_.back();
+        if (!item.min_known) {
+          auto *n = item.node;
+          while (n->children_.left_) {
+            n = n->children_.left_.get();
+          }
+          item.min_key = n->weight_;
+          item.min_known = true;
+        }
+        return item.min_key;
+      }
+
+      void pop() {
+        stack_.pop_back();
+      }
+
+      void expand() {
+        auto item = stack_.back();
+        assert(item.subtree);
+        stack_.pop_back();
+        const auto &[left, right] = item.node->children_;
+        if (right) {
+          stack_.push_back({right.get(), 0, false, true});
+        }
+        stack_.push_back({item.node, item.node->weight_, true, false});
+        if (left) {
+          stack_.push_back({left.get(), item.min_key, item.min_known, true});
+        }
+      }
 
-      int height = get_black_height(left);
-      if (height == -1) {
-        return -1;
+      template <typename F>
+      void consume(F &f) {
+        auto item = stack_.back();
+        stack_.pop_back();
+        if (item.subtree) {
+          for_each(item.node->children_.left_, f);
+        }
+        f(item.node->weight_, item.node->value_);
+        if (item.subtree) {
+          for_each(item.node->children_.right_, f);
+        }
       }
 
-      int right_height = get_black_height(right);
-      if (right_height == -1) {
-        return -1;
+    private:
+      std::vector<Item> stack_;
+    };
+
+    template <typename Added, typename Removed, typename Changed>
+    static void diff(const Ptr &old_root, const Ptr &new_root,
+                     Added &on_added, Removed &on_removed,
+                     Changed &on_changed) {
+      DiffCursor a(old_root);
+      DiffCursor b(new_root);
+
+      while (!a.empty() && !b.empty()) {
+        const auto &x = a.top();
+        const auto &y = b.top();
+
+        if (x.subtree && y.subtree) {
+          if (x.node == y.node) {
+            // shared subtree
+            a.pop();
+            b.pop();
+            continue;
+          }
+          // roots with the same key split both sides alike, so the shared
+          // subtrees below stay aligned without knowing where either starts;
+          // only where the versions differ in shape are the minimums walked
+          if (x.node->weight_ == y.node->weight_) {
+            a.expand();
+            b.expand();
+            continue;
+          }
+        }
+
+        auto x_min = a.min_key();
+        auto y_min = b.min_key();
+        if (x_min < y_min) {
+          if (x.subtree) {
+            a.expand();
+          } else {
+            a.consume(on_removed);
+          }
+          continue;
+        }
+
+        if (y_min < x_min) {
+          if (y.subtree) {
+            b.expand();
+          } else {
+            b.consume(on_added);
+          }
+          continue;
+        }
+
+        if (!x.subtree && !y.subtree) {
+          if (x.node->value_ != y.node->value_) {
+            on_changed(x.node->weight_, x.node->value_, y.node->value_);
+          }
+          a.pop();
+          b.pop();
+          continue;
+        }
+
+        // both sides start at the same key: a subtree shared by both versions
+        // can only hide inside the one with the larger root key
+        if (x.subtree && y.subtree) {
+          auto x_key = x.node->weight_;
+          auto y_key = y.node->weight_;
+          if (x_key >= y_key) {
+            a.expand();
+          }
+          if (y_key >= x_key) {
+            b.expand();
+          }
+        } else if (x.subtree) {
+          a.expand();
+        } else {
+          b.expand();
+        }
       }
 
-      if (height != right_height) {
-        return -1;
+      while (!a.empty()) {
+        a.consume(on_removed);
+      }
+      while (!b.empty()) {
+        b.consume(on_added);
       }
+    }
+
+    static bool check_invariant(const Ptr &node) {
+      return get_black_height(node) != -1;
+    }
 
-      return height + (node->color_ == Color::Black ? 1 : 0);
+    /// black height of the subtree, or -1 if it breaks an invariant
+    static int get_black_height(const Ptr &root) {
+      // post-order walk, `heights` holds the black heights of the finished
+      // subtrees. The tree may be invalid, so the stacks are not bounded by
+      // Path::kMaxDepth.
+      struct Frame {
+        const Node *node;
+        bool expanded;
+      };
+      std::vector<Frame> stack{{root.get(), false}};
+      std::vector<int> heights;
+      while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        if (!node || node->color_ == Color::DoubleBlackNil) {
+          stack.pop_back();
+          heights.push_back(1);
+          continue;
+        }
+        if (!expanded) {
+          if (node->size_ != 1 + size(node->children_.left_) +
+                                 size(node->children_.right_)) {
+            return -1;
+          }
+          if (node->is_red() && (node->is_red(Direction::Left) ||
+                                 node->is_red(Direction::Right))) {
+            return -1;
+          }
+          stack.back().expanded = true;
+          stack.push_back({node->children_.left_.get(), false});
+          stack.push_back({node->children_.right_.get(), false});
+          continue;
+        }
+        stack.pop_back();
+        auto right_height = heights.back();
+        heights.pop_back();
+        if (right_height != heights.back()) {
+          return -1;
+        }
+        heights.back() += node->color_ == Color::Black ? 1 : 0;
+      }
+      return heights.back();
     }
+
     static void print_tree(const Ptr &node, Direction d, int indent) {
       if (!node) {
         return;
@@ -712,6 +1721,249 @@ private:
     }
   };
 
-  std::shared_ptr<Node> root_;
-  uint64_t count_{};
+  template <typename F>
+  static void reconcile_range(const BasicRBTree &a, const BasicRBTree &b,
+                              uint64_t lo, uint64_t hi, F &on_range) {
+    if (a.aggregate(lo, hi) == b.aggregate(lo, hi)) {
+      return;
+    }
+    auto count_a = a.count(lo, hi);
+    auto count_b = b.count(lo, hi);
+    auto count = std::max(count_a, count_b);
+    if (count <= kReconcileRange) {
+      on_range(lo, hi);
+      return;
+    }
+    // the median of the larger side is less than `hi`, so both halves shrink
+    const auto &larger = count_a >= count_b ? a : b;
+    auto median = larger.select(larger.rank(lo) + (count - 1) / 2)->first;
+    reconcile_range(a, b, lo, median, on_range);
+    reconcile_range(a, b, median + 1, hi, on_range);
+  }
+
+  explicit BasicRBTree(typename Node::Ptr root)
+      : root_(Node::blacken(std::move(root))) {}
+
+  typename Node::Ptr root_;
+};
+
+using RBTree = BasicRBTree<>;
+
+namespace detail {
+
+/**
+ * Epoch based reclamation for ConcurrentRBTree. A reader announces the epoch
+ * it started in, in a slot owned by its thread, and clears it when done. A
+ * writer retires a version with the epoch it replaced it in, and frees it
+ * once every slot is idle or announces a later epoch: a reader which pinned
+ * a later epoch started after the replacement was published.
+ *
+ * Reading stores only to the thread's own cache line and loads lines which
+ * change once per published version, so readers neither wait nor contend
+ * with each other. Slots are claimed on the first read of a thread, released
+ * for reuse when it exits, and never freed.
+ */
+class Epochs {
+public:
+  constexpr Epochs() = default;
+  Epochs(const Epochs &) = delete;
+  Epochs &operator=(const Epochs &) = delete;
+
+  static Epochs &global() {
+    static constinit Epochs epochs;
+    return epochs;
+  }
+
+  /// pin the current epoch, nested pins on one thread share the outermost
+  void enter() noexcept {
+    auto &slot = own_slot();
+    if (slot.depth++ == 0) {
+      slot.epoch.store(epoch_.load());
+    }
+  }
+
+  void leave() noexcept {
+    auto &slot = own_slot();
+    if (--slot.depth == 0) {
+      slot.epoch.store(kIdle, std::memory_order_release);
+    }
+  }
+
+  /// start a new epoch and return the one it replaces, call after
+  /// unpublishing what is retired with the returned epoch
+  uint64_t advance() noexcept {
+    return epoch_.fetch_add(1);
+  }
+
+  /// the oldest epoch a reader has pinned, what was retired before it can
+  /// no longer be read
+  uint64_t oldest_pinned() const noexcept {
+    auto oldest = std::numeric_limits<uint64_t>::max();
+    for (auto *slot = slots_.load(std::memory_order_acquire); slot;
+         slot = slot->next) {
+      auto pinned = slot->epoch.load();
+      if (pinned != kIdle) {
+        oldest = std::min(oldest, pinned);
+      }
+    }
+    return oldest;
+  }
+
+private:
+  static constexpr uint64_t kIdle = 0;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{kIdle};
+    std::atomic<bool> owned{true};
+    uint32_t depth = 0;  // only touched by the owning thread
+    Slot *next = nullptr;
+  };
+
+  struct Owner {
+    Slot *slot;
+    explicit Owner(Epochs &epochs) : slot(epochs.claim()) {}
+    ~Owner() {
+      slot->owned.store(false, std::memory_order_release);
+    }
+  };
+
+  Slot &own_slot() {
+    thread_local Owner owner(*this);
+    return *owner.slot;
+  }
+
+  Slot *claim() {
+    for (auto *slot = slots_.load(std::memory_order_acquire); slot;
+         slot = slot->next) {
+      bool owned = false;
+      if (!slot->owned.load(std::memory_order_relaxed) &&
+          slot->owned.compare_exchange_strong(owned, true,
+                                              std::memory_order_acquire)) {
+        return slot;
+      }
+    }
+    auto *slot = new Slot;
+    slot->next = slots_.load(std::memory_order_relaxed);
+    while (!slots_.compare_exchange_weak(slot->next, slot,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+    return slot;
+  }
+
+  std::atomic<uint64_t> epoch_{1};
+  std::atomic<Slot *> slots_{nullptr};
+};
+
+}  // namespace detail
+
+/// ConcurrentRBTree publishes RBTree versions to concurrent readers.
+///
+/// Nodes are never modified once they are reachable from a published root, so
+/// a reader only has to obtain the current version atomically. `snapshot()`
+/// pins the current epoch in a slot of the calling thread and loads the
+/// version, it is wait-free and touches no reference count. Writers are
+/// serialized among themselves, publish each new version with a single atomic
+/// store and free the versions no reader can still hold.
+class ConcurrentRBTree {
+public:
+  /// A version pinned for reading. It must be released on the thread which
+  /// took it, and the writers can't free any version retired while it is
+  /// alive, so copy the RBTree out of it to keep a version for long.
+  class Snapshot {
+  public:
+    Snapshot(Snapshot &&other) noexcept
+        : tree_(std::exchange(other.tree_, nullptr)) {}
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    Snapshot &operator=(Snapshot &&) = delete;
+
+    ~Snapshot() {
+      if (tree_) {
+        detail::Epochs::global().leave();
+      }
+    }
+
+    const RBTree &operator*() const {
+      return *tree_;
+    }
+    const RBTree *operator->() const {
+      return tree_;
+    }
+
+  private:
+    friend class ConcurrentRBTree;
+
+    explicit Snapshot(const std::atomic<const RBTree *> &current) {
+      detail::Epochs::global().enter();
+      tree_ = current.load();
+    }
+
+    const RBTree *tree_;
+  };
+
+  ConcurrentRBTree() : current_(new RBTree()) {}
+  ConcurrentRBTree(const ConcurrentRBTree &) = delete;
+  ConcurrentRBTree &operator=(const ConcurrentRBTree &) = delete;
+
+  /// no reader may be left
+  ~ConcurrentRBTree() {
+    delete current_.load(std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const {
+    return Snapshot(current_);
+  }
+
+  std::optional<uint64_t> get(uint64_t key) const {
+    return snapshot()->get(key);
+  }
+
+  /// apply `f` to a private copy of the latest version and publish the result
+  template <typename F>
+  void update(F &&f) {
+    std::lock_guard lock(writer_mutex_);
+    // only writers free versions, so the latest one needs no pin here
+    auto next = std::make_unique<RBTree>(*current_.load());
+    std::forward<F>(f)(*next);
+    publish(std::move(next));
+  }
+
+  void insert(uint64_t key, uint64_t value) {
+    update([&](RBTree &tree) { tree.insert(key, value); });
+  }
+
+  bool remove(uint64_t key) {
+    bool removed = false;
+    update([&](RBTree &tree) { removed = tree.remove(key); });
+    return removed;
+  }
+
+  /// the number of replaced versions which readers may still hold
+  size_t retired() const {
+    std::lock_guard lock(writer_mutex_);
+    return retired_.size();
+  }
+
+private:
+  struct Retired {
+    uint64_t epoch;
+    std::unique_ptr<const RBTree> tree;
+  };
+
+  void publish(std::unique_ptr<const RBTree> next) {
+    std::unique_ptr<const RBTree> old(current_.exchange(next.release()));
+    retired_.push_back({detail::Epochs::global().advance(), std::move(old)});
+    // versions retire in epoch order, the oldest are freed first
+    auto oldest = detail::Epochs::global().oldest_pinned();
+    auto it = retired_.begin();
+    while (it != retired_.end() && it->epoch < oldest) {
+      ++it;
+    }
+    retired_.erase(retired_.begin(), it);
+  }
+
+  std::atomic<const RBTree *> current_;
+  mutable std::mutex writer_mutex_;
+  std::vector<Retired> retired_;  // guarded by writer_mutex_
 };
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <fmt/format.h>
+#include <pybind11/pybind11.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "outcome.hh"
+
+/**
+ * Python exceptions for the failures of Result-returning functions. Every
+ * registered enum gets an exception class deriving from <module>.Error, with
+ * the enum value as `value`, the payload (or None) as `payload`, the domain
+ * name as `domain` and the message as its argument. Failures of domains
+ * nobody registered raise <module>.Error itself with a None value.
+ *
+ *   PyErrors::get(m).add<MyErrc, std::string>("MyError");
+ *   def_result(m, "parse", &parse, py::arg("text"));
+ *
+ * Every module, submodules included, has its own tables and classes, so
+ * functions raise the classes of the module they are defined in.
+ * Registration happens while the module initializes and raising with the
+ * GIL held, so the tables need no lock.
+ */
+class PyErrors {
+public:
+  using StatusCode = SYSTEM_ERROR2_NAMESPACE::status_code<void>;
+
+  PyErrors(const PyErrors &) = delete;
+  PyErrors &operator=(const PyErrors &) = delete;
+
+  /// the tables of `m`, created with <module>.Error and
+  /// <module>.GenericError, which GenericErrc and generic_code raise, on the
+  /// first call
+  static PyErrors &get(pybind11::module_ &m) {
+    // leaked like the types, modules are never unloaded
+    static auto &modules =
+        *new std::unordered_map<PyObject *, std::unique_ptr<PyErrors>>();
+    auto &errors = modules[m.ptr()];
+    if (!errors) {
+      errors.reset(new PyErrors(m));
+    }
+    return *errors;
+  }
+
+  /// raise <module>.`name` for the errors of `Enum` carrying a `Payload`,
+  /// or none for void, and for the quick status codes of `Enum`
+  template <typename Enum, typename Payload = void>
+  void add(const char *name);
+
+  /// set the Python error for `code` and throw error_already_set
+  [[noreturn]] void raise(const StatusCode &code) const;
+
+private:
+  struct Entry {
+    pybind11::handle type;
+    pybind11::object (*value)(const StatusCode &);
+    pybind11::object (*payload)(const StatusCode &);
+  };
+
+  explicit PyErrors(pybind11::module_ &m) : module_(m) {
+    base_ = make_type("Error", PyExc_Exception);
+    add<GenericErrc>("GenericError");
+    entries_[&SYSTEM_ERROR2_NAMESPACE::generic_code_domain] = {
+        types_[domain_of<GenericErrc>()],
+        [](const StatusCode &code) -> pybind11::object {
+          using SYSTEM_ERROR2_NAMESPACE::generic_code;
+          const auto &c = static_cast<const generic_code &>(code);  // NOLINT
+          return pybind11::int_(static_cast<int64_t>(c.value()));
+        },
+        nullptr};
+  }
+
+  template <typename Enum>
+  static uint64_t domain_of() {
+    return SYSTEM_ERROR2_NAMESPACE::EnumPayloadDomainImpl<Enum,
+                                                          void>::payload_uuid;
+  }
+
+  // the types are leaked, they must outlive the interpreter's last use
+  pybind11::handle make_type(const char *name, PyObject *base) {
+    auto module_name = module_.attr("__name__").cast<std::string>();
+    auto qualified = fmt::format("{}.{}", module_name, name);
+    auto *type = PyErr_NewException(qualified.c_str(), base, nullptr);
+    if (!type) {
+      throw pybind11::error_already_set();
+    }
+    module_.attr(name) = pybind11::handle(type);
+    return type;
+  }
+
+  pybind11::handle module_;
+  pybind11::handle base_;
+  std::unordered_map<uint64_t, pybind11::handle> types_;
+  std::unordered_map<const SYSTEM_ERROR2_NAMESPACE::status_code_domain *,
+                     Entry>
+      entries_;
+};
+
+inline void PyErrors::raise(const StatusCode &code) const {
+  namespace py = pybind11;
+  using SYSTEM_ERROR2_NAMESPACE::ContextError;
+  using SYSTEM_ERROR2_NAMESPACE::IndirectCode;
+
+  // the message keeps the context() frames, the rest is the wrapped error
+  auto message = code.message();
+  const auto *inner = &code;
+  while (SYSTEM_ERROR2_NAMESPACE::is_nested_context(*inner)) {
+    const auto &c =
+        static_cast<const IndirectCode<ContextError> &>(*inner);  // NOLINT
+    inner = &c.value()->sc.value().error;
+  }
+
+  auto type = base_;
+  py::object value = py::none();
+  py::object payload = py::none();
+  py::object domain = py::none();
+  if (!inner->empty()) {
+    auto name = inner->domain().name();
+    domain = py::str(name.data(), name.size());
+    if (auto it = entries_.find(&inner->domain()); it != entries_.end()) {
+      type = it->second.type;
+      value = it->second.value(*inner);
+      if (it->second.payload) {
+        payload = it->second.payload(*inner);
+      }
+    }
+  }
+
+  auto error = type(py::str(message.data(), message.size()));
+  error.attr("domain") = domain;
+  error.attr("value") = value;
+  error.attr("payload") = payload;
+  PyErr_SetObject(type.ptr(), error.ptr());
+  throw py::error_already_set();
+}
+
+template <typename Enum, typename Payload>
+void PyErrors::add(const char *name) {
+  namespace py = pybind11;
+  using SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_code;
+  using SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_domain;
+  using SYSTEM_ERROR2_NAMESPACE::IndirectCode;
+  using Error = SYSTEM_ERROR2_NAMESPACE::EnumPayloadError<Enum, Payload>;
+
+  auto [it, added] = types_.try_emplace(domain_of<Enum>());
+  if (added) {
+    it->second = make_type(name, base_.ptr());
+  }
+  auto type = it->second;
+  if constexpr (!std::is_void_v<Payload>) {
+    add<Enum>(name);
+  }
+
+  // the indirecting domain of Error has no name outside of an erased code
+  typename Error::value_type probe_value{};
+  SYSTEM_ERROR2_NAMESPACE::system_code probe =
+      make_status_code(Error(std::move(probe_value)));
+
+  entries_[&probe.domain()] = {
+      type,
+      [](const StatusCode &code) -> py::object {
+        const auto &c =
+            static_cast<const IndirectCode<Error> &>(code);  // NOLINT
+        return py::int_(static_cast<int64_t>(c.value()->sc.value().value));
+      },
+      [](const StatusCode &code) -> py::object {
+        if constexpr (std::is_void_v<Payload>) {
+          (void)code;
+          return py::none();
+        } else {
+          const auto &c =
+              static_cast<const IndirectCode<Error> &>(code);  // NOLINT
+          return py::cast(c.value()->sc.value().payload);
+        }
+      }};
+  entries_[&quick_status_code_from_enum_domain<Enum>] = {
+      type,
+      [](const StatusCode &code) -> py::object {
+        using QuickCode = quick_status_code_from_enum_code<Enum>;
+        const auto &c = static_cast<const QuickCode &>(code);  // NOLINT
+        return py::int_(static_cast<int64_t>(c.value()));
+      },
+      nullptr};
+}
+
+/**
+ * `f` as a function for pybind11 which returns the value of the Result or
+ * raises its failure through `errors`. The GIL is released while `f` runs,
+ * the arguments are converted before that, so `f` must not take Python
+ * objects.
+ */
+template <typename R, typename... Args>
+auto unwrap_result(const PyErrors &errors, Result<R> (*f)(Args...)) {
+  return [&errors, f](Args... args) -> R {
+    auto r = [&] {
+      pybind11::gil_scoped_release release;
+      return f(std::forward<Args>(args)...);
+    }();
+    if (r.has_error()) {
+      errors.raise(r.error());
+    }
+    if constexpr (!std::is_void_v<R>) {
+      return std::move(r).value();
+    }
+  };
+}
+
+template <typename R, typename... Args, typename... Extra>
+void def_result(pybind11::module_ &m, const char *name,
+                Result<R> (*f)(Args...), const Extra &...extra) {
+  m.def(name, unwrap_result(PyErrors::get(m), f), extra...);
+}
@@ -1,13 +1,50 @@
 #include <pybind11/pybind11.h>
 
+#include <charconv>
+#include <cmath>
+#include <string>
+
+#include "py-result.hh"
+
 namespace py = pybind11;
 
+enum class PyErrc { not_a_number, out_of_range };
+
+QUICK_STATUS_CODE(PyErrc, not_a_number, out_of_range)
+
 int add(int i, int j) {
   return i + j;
 }
 
+Result<int64_t> parse_int(const std::string &text) {
+  int64_t value = 0;
+  auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec == std::errc::result_out_of_range) {
+    return make_error(PyErrc::out_of_range, text);
+  }
+  if (ec != std::errc{} || end != text.data() + text.size()) {
+    return make_error(PyErrc::not_a_number, text);
+  }
+  return value;
+}
+
+Result<double> checked_sqrt(double x) {
+  if (x < 0) {
+    return make_error(GenericErrc::argument_out_of_domain);
+  }
+  return std::sqrt(x);
+}
+
 PYBIND11_MODULE(foopy, m) {
   m.doc() = "pybind11 foo example plugin";
   m.def("add", &add, "A function which adds two numbers", py::arg("i"),
         py::arg("j"));
-}
\ No newline at end of file
+
+  PyErrors::get(m).add<PyErrc, std::string>("ParseError");
+  def_result(m, "parse_int", &parse_int,
+             "Parse a decimal integer, raises ParseError", py::arg("text"));
+  def_result(m, "checked_sqrt", &checked_sqrt,
+             "The square root of x, raises GenericError for a negative x",
+             py::arg("x"));
+}
@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+#include <pybind11/embed.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "outcome.hh"
+
+namespace py = pybind11;
+
+namespace {
+
+// one interpreter for the whole test, foopy is imported from where the build
+// put it
+py::module_ foopy() {
+  static py::scoped_interpreter interpreter;
+  static bool path_set = [] {
+    py::module_::import("sys").attr("path").attr("insert")(0, FOOPY_DIR);
+    return true;
+  }();
+  (void)path_set;
+  return py::module_::import("foopy");
+}
+
+/// the exception raised by foopy.`name`(`arg`)
+py::object raised(const char *name, const py::object &arg) {
+  try {
+    foopy().attr(name)(arg);
+  } catch (py::error_already_set &e) {
+    return e.value();
+  }
+  ADD_FAILURE() << name << " did not raise";
+  return py::none();
+}
+
+}  // namespace
+
+TEST(PyResult, parse_int) {
+  auto m = foopy();
+  EXPECT_EQ(m.attr("parse_int")("-42").cast<int64_t>(), -42);
+
+  auto error = raised("parse_int", py::str("4x2"));
+  EXPECT_TRUE(py::isinstance(error, m.attr("ParseError")));
+  EXPECT_TRUE(py::isinstance(error, m.attr("Error")));
+  EXPECT_EQ(error.attr("domain").cast<std::string>(), "PyErrc");
+  // PyErrc::not_a_number
+  EXPECT_EQ(error.attr("value").cast<int64_t>(), 0);
+  EXPECT_EQ(error.attr("payload").cast<std::string>(), "4x2");
+  EXPECT_FALSE(py::str(error).cast<std::string>().empty());
+
+  error = raised("parse_int", py::str("99999999999999999999"));
+  EXPECT_TRUE(py::isinstance(error, m.attr("ParseError")));
+  // PyErrc::out_of_range
+  EXPECT_EQ(error.attr("value").cast<int64_t>(), 1);
+}
+
+TEST(PyResult, checked_sqrt) {
+  auto m = foopy();
+  EXPECT_EQ(m.attr("checked_sqrt")(4.0).cast<double>(), 2.0);
+
+  auto error = raised("checked_sqrt", py::float_(-1.0));
+  EXPECT_TRUE(py::isinstance(error, m.attr("GenericError")));
+  EXPECT_TRUE(py::isinstance(error, m.attr("Error")));
+  EXPECT_FALSE(py::isinstance(error, m.attr("ParseError")));
+  EXPECT_EQ(error.attr("domain").cast<std::string>(), "GenericErrc");
+  EXPECT_EQ(error.attr("value").cast<int64_t>(),
+            static_cast<int64_t>(GenericErrc::argument_out_of_domain));
+  EXPECT_TRUE(error.attr("payload").is_none());
+}
+
+TEST(PyResult, caught_in_python) {
+  py::dict scope;
+  scope["foopy"] = foopy();
+  py::exec(R"(
+try:
+    foopy.parse_int("x")
+    caught = None
+except foopy.Error as e:
+    caught = f"{type(e).__module__}.{type(e).__name__}"
+)",
+           scope);
+  EXPECT_EQ(scope["caught"].cast<std::string>(), "foopy.ParseError");
+}
+
+// parse_int drops the GIL while it runs and takes it back to raise, from
+// threads contending for it
+TEST(PyResult, released_gil) {
+  py::dict scope;
+  scope["foopy"] = foopy();
+  py::exec(R"(
+import threading
+
+def work(results, i):
+    ok = errors = 0
+    for j in range(200):
+        try:
+            if foopy.parse_int(str(i * 1000 + j)) == i * 1000 + j:
+                ok += 1
+            foopy.parse_int(f"{j}x")
+        except foopy.ParseError as e:
+            if e.payload == f"{j}x":
+                errors += 1
+    results[i] = (ok, errors)
+
+results = [None] * 8
+threads = [threading.Thread(target=work, args=(results, i)) for i in range(8)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+)",
+           scope);
+  auto results = scope["results"].cast<py::list>();
+  ASSERT_EQ(results.size(), 8);
+  for (auto result : results) {
+    EXPECT_EQ(result.cast<std::pair<int, int>>(), std::make_pair(200, 200));
+  }
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "persistent-rbtree.hh"
+
+/**
+ * BasicRBTreeHistory retains recent versions of a tree for time-travel reads
+ * and keeps the memory they pin under a budget.
+ *
+ * Every committed version gets the next version number. The history counts
+ * the nodes reachable from the retained versions, each node once however many
+ * versions share it, and evicts the oldest versions while those nodes and the
+ * table counting them exceed the budget. The latest version is never evicted.
+ *
+ * A snapshot handed out by at() which is still held when its version is
+ * evicted keeps being counted, until the first commit() or set_budget() after
+ * the last reader dropped it, so readers holding old versions make the history
+ * evict more instead of growing past the budget. A tree copied out of a
+ * snapshot is not counted.
+ */
+template <RBTreeMonoid Monoid>
+class BasicRBTreeHistory {
+  using Tree = BasicRBTree<Monoid>;
+  using Node = typename Tree::Node;
+
+public:
+  using Snapshot = std::shared_ptr<const Tree>;
+
+  explicit BasicRBTreeHistory(uint64_t budget_bytes)
+      : budget_bytes_(budget_bytes) {}
+
+  /// retain `tree` as the next version and return its number
+  uint64_t commit(const Tree &tree) {
+    std::lock_guard lock(mutex_);
+    release_dropped();
+    retain(tree.root_.get());
+    versions_.push_back(std::make_shared<const Tree>(tree));
+    evict();
+    return first_version_ + versions_.size() - 1;
+  }
+
+  /// the tree at `version`, or null if it was evicted or not committed yet
+  Snapshot at(uint64_t version) const {
+    std::lock_guard lock(mutex_);
+    if (version < first_version_ ||
+        version - first_version_ >= versions_.size()) {
+      return nullptr;
+    }
+    return versions_[version - first_version_];
+  }
+
+  /// the oldest retained version and the latest one, if any was committed
+  std::optional<std::pair<uint64_t, uint64_t>> range() const {
+    std::lock_guard lock(mutex_);
+    if (versions_.empty()) {
+      return std::nullopt;
+    }
+    return std::pair{first_version_, first_version_ + versions_.size() - 1};
+  }
+
+  /// number of distinct nodes in the retained and held versions
+  uint64_t live_nodes() const {
+    std::lock_guard lock(mutex_);
+    return refs_.size();
+  }
+
+  /// the bytes of those nodes and of the table counting them
+  uint64_t live_bytes() const {
+    std::lock_guard lock(mutex_);
+    return bytes();
+  }
+
+  /// number of evicted versions still held by readers
+  uint64_t held_versions() const {
+    std::lock_guard lock(mutex_);
+    return held_.size();
+  }
+
+  void set_budget(uint64_t budget_bytes) {
+    std::lock_guard lock(mutex_);
+    budget_bytes_ = budget_bytes;
+    release_dropped();
+    evict();
+  }
+
+private:
+  // Nodes are counted by the references they get from counted roots and
+  // from the counted parents, so a node enters the set once and only its
+  // first reference walks into its children. Retained and held versions keep
+  // every counted node alive, so addresses are not reused while counted.
+
+  void retain(const Node *root) {
+    std::vector<const Node *> stack;
+    if (root) {
+      stack.push_back(root);
+    }
+    while (!stack.empty()) {
+      const auto *node = stack.back();
+      stack.pop_back();
+      if (refs_[node]++ > 0) {
+        continue;
+      }
+      for (const auto *child :
+           {node->children_.left_.get(), node->children_.right_.get()}) {
+        if (child) {
+          stack.push_back(child);
+        }
+      }
+    }
+  }
+
+  void release(const Node *root) {
+    std::vector<const Node *> stack;
+    if (root) {
+      stack.push_back(root);
+    }
+    while (!stack.empty()) {
+      const auto *node = stack.back();
+      stack.pop_back();
+      auto it = refs_.find(node);
+      assert(it != refs_.end());
+      if (--it->second > 0) {
+        continue;
+      }
+      refs_.erase(it);
+      for (const auto *child :
+           {node->children_.left_.get(), node->children_.right_.get()}) {
+        if (child) {
+          stack.push_back(child);
+        }
+      }
+    }
+  }
+
+  // a table slot is the entry and a control byte
+  uint64_t bytes() const {
+    return refs_.size() * sizeof(Node) +
+           refs_.capacity() * (sizeof(typename Refs::value_type) + 1);
+  }
+
+  void evict() {
+    while (versions_.size() > 1 && bytes() > budget_bytes_) {
+      auto version = std::move(versions_.front());
+      versions_.pop_front();
+      first_version_++;
+      if (version.use_count() > 1) {
+        held_.push_back(std::move(version));
+      } else {
+        // release before dropping, the version keeps the nodes alive
+        release(version->root_.get());
+      }
+    }
+  }
+
+  // only the history can hand out a held version, so once it is the last
+  // owner nobody can get it back
+  void release_dropped() {
+    std::erase_if(held_, [&](const Snapshot &version) {
+      if (version.use_count() > 1) {
+        return false;
+      }
+      release(version->root_.get());
+      return true;
+    });
+  }
+
+  using Refs = absl::flat_hash_map<const Node *, uint64_t>;
+
+  mutable std::mutex mutex_;
+  uint64_t budget_bytes_;
+  uint64_t first_version_ = 0;
+  std::deque<Snapshot> versions_;
+  std::vector<Snapshot> held_;  // evicted, but still held by readers
+  Refs refs_;
+};
+
+using RBTreeHistory = BasicRBTreeHistory<EmptyMonoid>;
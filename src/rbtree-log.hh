@@ -0,0 +1,443 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/crc.hpp>
+#include <fmt/format.h>
+
+#include "persistent-rbtree.hh"
+
+/**
+ * On-disk log of RBTree versions.
+ *
+ * The file is a sequence of segments, one per appended version:
+ *
+ *   SegmentHeader {magic, n_nodes, root, count, checksum, reserved}
+ *   NodeRecord    {key, value, left, right} * n_nodes
+ *
+ * Node references are byte offsets into the file, 0 is nil. Every record is
+ * written once: a later version only appends the nodes it copied and points
+ * to the records of the nodes it shares with earlier versions. Children are
+ * written before their parents, so references always point backwards, and
+ * the color of a node is kept in the low bit of its `left` reference since
+ * records are 32 byte aligned. Integers are stored in host byte order.
+ *
+ * The checksum is the CRC-32 of the header, with the checksum zeroed, and of
+ * the records. A segment cut short by a crash, or one whose checksum doesn't
+ * match because a write only partly reached the disk, ends the log: readers
+ * ignore it and everything after it, and the next writer truncates it away.
+ */
+namespace rbtree_log {
+
+inline constexpr uint64_t kMagic = 0x32474f4c45455254;  // "TREELOG2"
+inline constexpr uint64_t kRedBit = 1;
+
+struct SegmentHeader {
+  uint64_t magic;
+  uint64_t n_nodes;
+  uint64_t root;
+  uint64_t count;
+  uint64_t checksum;
+  uint64_t reserved[3];  // keeps the records 32 byte aligned
+};
+
+struct NodeRecord {
+  uint64_t key;
+  uint64_t value;
+  uint64_t left;
+  uint64_t right;
+};
+
+static_assert(sizeof(SegmentHeader) == 64);
+static_assert(sizeof(NodeRecord) == 32);
+
+/// the checksum of a segment, `records(crc)` processes its records
+template <typename F>
+uint64_t checksum(SegmentHeader header, F &&records) {
+  boost::crc_32_type crc;
+  header.checksum = 0;
+  crc.process_bytes(&header, sizeof(header));
+  records(crc);
+  return crc.checksum();
+}
+
+/**
+ * walk the complete segments of a file of `size` bytes, `read(out, n,
+ * offset)` copies `n` bytes at `offset`, returns the end of the last
+ * complete segment whose checksum matches
+ */
+template <typename Read, typename F>
+uint64_t scan(uint64_t size, Read &&read, F &&on_segment) {
+  constexpr uint64_t kChunk = 1 << 16;
+  std::vector<char> buffer;
+  uint64_t offset = 0;
+  while (offset + sizeof(SegmentHeader) <= size) {
+    SegmentHeader header{};
+    read(&header, sizeof(header), offset);
+    if (header.magic != kMagic) {
+      if (offset == 0) {
+        throw std::runtime_error("not an rbtree log");
+      }
+      break;
+    }
+    auto nodes_begin = offset + sizeof(SegmentHeader);
+    if (header.n_nodes > (size - nodes_begin) / sizeof(NodeRecord)) {
+      break;
+    }
+    auto end = nodes_begin + header.n_nodes * sizeof(NodeRecord);
+    auto sum = checksum(header, [&](boost::crc_32_type &crc) {
+      for (auto at = nodes_begin; at < end;) {
+        auto n = std::min(end - at, kChunk);
+        buffer.resize(n);
+        read(buffer.data(), n, at);
+        crc.process_bytes(buffer.data(), n);
+        at += n;
+      }
+    });
+    if (sum != header.checksum) {
+      break;
+    }
+    if (header.root >= end) {
+      throw std::runtime_error("corrupted rbtree log");
+    }
+    on_segment(header);
+    offset = end;
+  }
+  return offset;
+}
+
+}  // namespace rbtree_log
+
+/// appends versions of a BasicRBTree<Monoid> to a log file
+template <RBTreeMonoid Monoid>
+class BasicRBTreeLogWriter {
+  using Tree = BasicRBTree<Monoid>;
+  using Node = typename Tree::Node;
+  using Ptr = typename Node::Ptr;
+
+public:
+  explicit BasicRBTreeLogWriter(const std::string &path)
+      : fd_(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+    if (fd_ == -1) {
+      throw std::runtime_error(
+          fmt::format("can not open {}: {}", path, strerror(errno)));
+    }
+    try {
+      struct stat st{};
+      if (fstat(fd_, &st) == -1) {
+        throw std::runtime_error(strerror(errno));
+      }
+      auto size = static_cast<uint64_t>(st.st_size);
+      end_ = rbtree_log::scan(
+          size,
+          [&](void *out, uint64_t n, uint64_t offset) {
+            read_all(out, n, offset);
+          },
+          [&](const rbtree_log::SegmentHeader &) { versions_++; });
+      if (end_ != size && ftruncate(fd_, static_cast<off_t>(end_)) == -1) {
+        throw std::runtime_error(strerror(errno));
+      }
+    } catch (...) {
+      close(fd_);
+      throw;
+    }
+  }
+
+  BasicRBTreeLogWriter(const BasicRBTreeLogWriter &) = delete;
+  BasicRBTreeLogWriter &operator=(const BasicRBTreeLogWriter &) = delete;
+
+  ~BasicRBTreeLogWriter() {
+    close(fd_);
+  }
+
+  /**
+   * append `tree` as a new version and fdatasync it, returns the index of the
+   * version
+   *
+   * Only the nodes not written by an earlier append() of this writer are
+   * written. The writer keeps the written nodes alive so their addresses are
+   * not reused, and forgets the ones no longer reachable from the latest
+   * version once they outnumber the live ones.
+   */
+  size_t append(const Tree &tree) {
+    auto nodes_begin = end_ + sizeof(rbtree_log::SegmentHeader);
+    std::vector<rbtree_log::NodeRecord> records;
+
+    // post-order walk pruned at the nodes already in the log
+    std::vector<std::pair<Node *, bool>> stack;
+    auto push = [&](Node *node) {
+      if (node && !offsets_.contains(node)) {
+        stack.emplace_back(node, false);
+      }
+    };
+    push(tree.root_.get());
+    while (!stack.empty()) {
+      auto [node, expanded] = stack.back();
+      if (!expanded) {
+        stack.back().second = true;
+        push(node->children_.right_.get());
+        push(node->children_.left_.get());
+        continue;
+      }
+      stack.pop_back();
+      auto offset = nodes_begin + records.size() * sizeof(records[0]);
+      auto red = node->color_ == Node::Color::Red ? rbtree_log::kRedBit : 0;
+      records.push_back({.key = node->weight_,
+                         .value = node->value_,
+                         .left = offset_of(node->children_.left_) | red,
+                         .right = offset_of(node->children_.right_)});
+      offsets_.emplace(node, Written{offset, Ptr(node)});
+    }
+
+    rbtree_log::SegmentHeader header{.magic = rbtree_log::kMagic,
+                                     .n_nodes = records.size(),
+                                     .root = offset_of(tree.root_),
+                                     .count = tree.size()};
+    header.checksum =
+        rbtree_log::checksum(header, [&](boost::crc_32_type &crc) {
+          crc.process_bytes(records.data(),
+                            records.size() * sizeof(records[0]));
+        });
+    write_all(&header, sizeof(header), end_);
+    write_all(records.data(), records.size() * sizeof(records[0]),
+              nodes_begin);
+    if (fdatasync(fd_) == -1) {
+      throw std::runtime_error(strerror(errno));
+    }
+    end_ = nodes_begin + records.size() * sizeof(records[0]);
+
+    if (offsets_.size() > 2 * tree.size()) {
+      compact(tree);
+    }
+    return versions_++;
+  }
+
+  size_t versions() const {
+    return versions_;
+  }
+
+private:
+  struct Written {
+    uint64_t offset;
+    Ptr node;
+  };
+
+  uint64_t offset_of(const Ptr &node) const {
+    return node ? offsets_.at(node.get()).offset : 0;
+  }
+
+  void compact(const Tree &tree) {
+    std::unordered_map<const Node *, Written> live;
+    live.reserve(tree.size());
+    std::vector<Node *> stack;
+    if (tree.root_) {
+      stack.push_back(tree.root_.get());
+    }
+    while (!stack.empty()) {
+      auto *node = stack.back();
+      stack.pop_back();
+      live.emplace(node, std::move(offsets_.at(node)));
+      for (auto *child :
+           {node->children_.left_.get(), node->children_.right_.get()}) {
+        if (child) {
+          stack.push_back(child);
+        }
+      }
+    }
+    offsets_ = std::move(live);
+  }
+
+  void write_all(const void *data, size_t size, uint64_t offset) {
+    const auto *p = static_cast<const char *>(data);
+    while (size > 0) {
+      auto n = pwrite(fd_, p, size, static_cast<off_t>(offset));
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(strerror(errno));
+      }
+      p += n;
+      size -= n;
+      offset += n;
+    }
+  }
+
+  void read_all(void *data, size_t size, uint64_t offset) {
+    auto *p = static_cast<char *>(data);
+    while (size > 0) {
+      auto n = pread(fd_, p, size, static_cast<off_t>(offset));
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        throw std::runtime_error(n == 0 ? "short read" : strerror(errno));
+      }
+      p += n;
+      size -= n;
+      offset += n;
+    }
+  }
+
+  int fd_;
+  uint64_t end_ = 0;
+  size_t versions_ = 0;
+  std::unordered_map<const Node *, Written> offsets_;
+};
+
+using RBTreeLogWriter = BasicRBTreeLogWriter<EmptyMonoid>;
+
+/**
+ * RBTreeLogReader maps a log file and answers queries on any of its versions
+ * straight from the mapping, without building nodes in memory. It sees the
+ * versions that were complete when it was opened, and verifies their
+ * checksums once, when it opens the file.
+ */
+class RBTreeLogReader {
+public:
+  explicit RBTreeLogReader(const std::string &path) {
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      throw std::runtime_error(
+          fmt::format("can not open {}: {}", path, strerror(errno)));
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+      auto err = errno;
+      close(fd);
+      throw std::runtime_error(strerror(err));
+    }
+    mapped_ = static_cast<uint64_t>(st.st_size);
+    if (mapped_ > 0) {
+      auto *addr = mmap(nullptr, mapped_, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        auto err = errno;
+        close(fd);
+        throw std::runtime_error(strerror(err));
+      }
+      data_ = static_cast<const char *>(addr);
+    }
+    close(fd);
+
+    try {
+      size_ = rbtree_log::scan(
+          mapped_,
+          [&](void *out, uint64_t n, uint64_t offset) {
+            memcpy(out, data_ + offset, n);
+          },
+          [&](const rbtree_log::SegmentHeader &header) {
+            versions_.push_back({header.root, header.count});
+          });
+    } catch (...) {
+      unmap();
+      throw;
+    }
+  }
+
+  RBTreeLogReader(const RBTreeLogReader &) = delete;
+  RBTreeLogReader &operator=(const RBTreeLogReader &) = delete;
+
+  ~RBTreeLogReader() {
+    unmap();
+  }
+
+  size_t versions() const {
+    return versions_.size();
+  }
+
+  /// number of keys in `version`
+  uint64_t size(size_t version) const {
+    return versions_.at(version).count;
+  }
+
+  std::optional<uint64_t> get(size_t version, uint64_t key) const {
+    auto offset = versions_.at(version).root;
+    while (offset) {
+      const auto &node = record(offset);
+      if (node.key == key) {
+        return node.value;
+      }
+      offset = child(offset, key < node.key ? node.left : node.right);
+    }
+    return std::nullopt;
+  }
+
+  /// call `f(key, value)` for the keys of `version` in [lo, hi], in order
+  template <typename F>
+  void for_each(size_t version, uint64_t lo, uint64_t hi, F &&f) const {
+    // in-order walk of the left spines, skipping subtrees outside the range
+    std::vector<uint64_t> stack;
+    auto descend = [&](uint64_t offset) {
+      while (offset) {
+        const auto &node = record(offset);
+        if (node.key < lo) {
+          offset = child(offset, node.right);
+          continue;
+        }
+        stack.push_back(offset);
+        offset = child(offset, node.left);
+      }
+    };
+    descend(versions_.at(version).root);
+    while (!stack.empty()) {
+      auto offset = stack.back();
+      stack.pop_back();
+      const auto &node = record(offset);
+      if (node.key > hi) {
+        return;
+      }
+      f(node.key, node.value);
+      descend(child(offset, node.right));
+    }
+  }
+
+private:
+  struct Version {
+    uint64_t root;
+    uint64_t count;
+  };
+
+  const rbtree_log::NodeRecord &record(uint64_t offset) const {
+    if (offset % sizeof(rbtree_log::NodeRecord) != 0 ||
+        offset < sizeof(rbtree_log::SegmentHeader) ||
+        offset + sizeof(rbtree_log::NodeRecord) > size_) {
+      throw std::runtime_error("corrupted rbtree log");
+    }
+    return *reinterpret_cast<const rbtree_log::NodeRecord *>(data_ + offset);
+  }
+
+  /// strip the color bit, children are always written before their parent
+  static uint64_t child(uint64_t parent, uint64_t reference) {
+    auto offset = reference & ~rbtree_log::kRedBit;
+    if (offset >= parent) {
+      throw std::runtime_error("corrupted rbtree log");
+    }
+    return offset;
+  }
+
+  void unmap() {
+    if (data_) {
+      munmap(const_cast<char *>(data_), mapped_);
+    }
+  }
+
+  const char *data_ = nullptr;
+  uint64_t mapped_ = 0;
+  // end of the last complete segment
+  uint64_t size_ = 0;
+  std::vector<Version> versions_;
+};
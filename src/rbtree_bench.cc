@@ -0,0 +1,396 @@
+// Benchmarks the persistent RBTree against std::map, absl::btree_map and a
+// copy-on-write std::map, printing one JSON record per measurement:
+//
+//   rbtree_bench --sizes=1000,1000000 --distributions=random,zipfian
+//
+// Memory is measured in an untimed build of each container of its own, by
+// counting the usable size of the blocks allocated through the global
+// operator new while it runs. The timed loops allocate without counting.
+
+#include <absl/container/btree_map.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/parse.h>
+#include <absl/flags/usage.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bench.hh"
+#include "persistent-rbtree.hh"
+
+ABSL_FLAG(std::vector<std::string>, sizes,
+          std::vector<std::string>({"1000", "100000", "1000000"}),
+          "Number of keys to insert, up to 100000000");
+ABSL_FLAG(std::vector<std::string>, distributions,
+          std::vector<std::string>({"random", "sequential", "zipfian"}),
+          "Key distributions: random, sequential, zipfian");
+ABSL_FLAG(std::vector<std::string>, containers,
+          std::vector<std::string>({"rbtree", "std_map", "btree_map",
+                                    "cow_map"}),
+          "Containers to measure");
+ABSL_FLAG(uint64_t, lookups, 1000000, "Number of point lookups");
+ABSL_FLAG(uint64_t, seed, 42, "Seed of the key generators");
+ABSL_FLAG(std::string, output, "", "Write JSON here instead of stdout");
+
+namespace {
+
+using bench::AllocationCounter;
+using bench::Reporter;
+using bench::sink;
+using bench::time_per_op;
+
+using Map = std::map<uint64_t, uint64_t>;
+
+struct RBTreeBench {
+  static constexpr auto kName = "rbtree";
+  using Snapshot = RBTree;
+
+  RBTree tree;
+
+  void insert(uint64_t key, uint64_t value) {
+    tree.insert(key, value);
+  }
+  void remove(uint64_t key) {
+    tree.remove(key);
+  }
+  std::optional<uint64_t> get(uint64_t key) const {
+    return tree.get(key);
+  }
+  uint64_t scan(uint64_t lo, uint64_t hi) const {
+    uint64_t sum = 0;
+    tree.for_each(lo, hi, [&](uint64_t, uint64_t value) { sum += value; });
+    return sum;
+  }
+  Snapshot snapshot() const {
+    return tree;
+  }
+  uint64_t size() const {
+    return tree.size();
+  }
+};
+
+template <typename M>
+struct MapBench {
+  using Snapshot = M;
+
+  M map;
+
+  void insert(uint64_t key, uint64_t value) {
+    map.insert_or_assign(key, value);
+  }
+  void remove(uint64_t key) {
+    map.erase(key);
+  }
+  std::optional<uint64_t> get(uint64_t key) const {
+    auto it = map.find(key);
+    if (it == map.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+  uint64_t scan(uint64_t lo, uint64_t hi) const {
+    uint64_t sum = 0;
+    for (auto it = map.lower_bound(lo); it != map.end() && it->first <= hi;
+         ++it) {
+      sum += it->second;
+    }
+    return sum;
+  }
+  // the only way to keep an old version is a full copy
+  Snapshot snapshot() const {
+    return map;
+  }
+  uint64_t size() const {
+    return map.size();
+  }
+};
+
+struct StdMapBench : MapBench<Map> {
+  static constexpr auto kName = "std_map";
+};
+
+struct BtreeMapBench : MapBench<absl::btree_map<uint64_t, uint64_t>> {
+  static constexpr auto kName = "btree_map";
+};
+
+/// std::map shared between snapshots and copied by the first write after one
+struct CowMapBench {
+  static constexpr auto kName = "cow_map";
+  using Snapshot = std::shared_ptr<const Map>;
+
+  std::shared_ptr<Map> map = std::make_shared<Map>();
+
+  Map &mutable_map() {
+    if (map.use_count() > 1) {
+      map = std::make_shared<Map>(*map);
+    }
+    return *map;
+  }
+
+  void insert(uint64_t key, uint64_t value) {
+    mutable_map().insert_or_assign(key, value);
+  }
+  void remove(uint64_t key) {
+    mutable_map().erase(key);
+  }
+  std::optional<uint64_t> get(uint64_t key) const {
+    auto it = map->find(key);
+    if (it == map->end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+  uint64_t scan(uint64_t lo, uint64_t hi) const {
+    uint64_t sum = 0;
+    for (auto it = map->lower_bound(lo); it != map->end() && it->first <= hi;
+         ++it) {
+      sum += it->second;
+    }
+    return sum;
+  }
+  Snapshot snapshot() const {
+    return map;
+  }
+  uint64_t size() const {
+    return map->size();
+  }
+};
+
+uint64_t mix(uint64_t x) {
+  // splitmix64 finalizer
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+/// ranks in [0, n) following a zipfian distribution, as in YCSB
+class Zipfian {
+public:
+  explicit Zipfian(uint64_t n, double theta = 0.99)
+      : n_(n), theta_(theta), alpha_(1 / (1 - theta)), zetan_(zeta(n, theta)) {
+    eta_ = (1 - std::pow(2.0 / static_cast<double>(n), 1 - theta)) /
+           (1 - zeta(2, theta) / zetan_);
+  }
+
+  uint64_t operator()(std::mt19937_64 &rng) const {
+    auto u = std::uniform_real_distribution<double>(0, 1)(rng);
+    auto uz = u * zetan_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + std::pow(0.5, theta_)) {
+      return 1;
+    }
+    auto rank = static_cast<uint64_t>(static_cast<double>(n_) *
+                                      std::pow(eta_ * u - eta_ + 1, alpha_));
+    return std::min(rank, n_ - 1);
+  }
+
+private:
+  static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+      sum += 1 / std::pow(static_cast<double>(i), theta);
+    }
+    return sum;
+  }
+
+  uint64_t n_;
+  double theta_;
+  double alpha_;
+  double zetan_;
+  double eta_;
+};
+
+struct Workload {
+  std::string distribution;
+  // inserted in this order, zipfian keys repeat
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> lookups;
+  // [lo, hi] ranges of about 100 keys
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+};
+
+Workload make_workload(const std::string &distribution, uint64_t n,
+                       uint64_t n_lookups, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  Workload w;
+  w.distribution = distribution;
+  w.keys.reserve(n);
+  w.lookups.reserve(n_lookups);
+  if (distribution == "random") {
+    for (uint64_t i = 0; i < n; i++) {
+      w.keys.push_back(rng());
+    }
+    for (uint64_t i = 0; i < n_lookups; i++) {
+      w.lookups.push_back(w.keys[rng() % n]);
+    }
+  } else if (distribution == "sequential") {
+    for (uint64_t i = 0; i < n; i++) {
+      w.keys.push_back(i);
+    }
+    for (uint64_t i = 0; i < n_lookups; i++) {
+      w.lookups.push_back(i % n);
+    }
+  } else if (distribution == "zipfian") {
+    Zipfian zipf(n);
+    for (uint64_t i = 0; i < n; i++) {
+      w.keys.push_back(mix(zipf(rng)));
+    }
+    for (uint64_t i = 0; i < n_lookups; i++) {
+      w.lookups.push_back(mix(zipf(rng)));
+    }
+  } else {
+    throw std::invalid_argument(
+        fmt::format("unknown distribution {}", distribution));
+  }
+
+  auto sorted = w.keys;
+  std::ranges::sort(sorted);
+  auto [end, _] = std::ranges::unique(sorted);
+  sorted.erase(end, sorted.end());
+  for (int i = 0; i < 1000; i++) {
+    auto lo = rng() % sorted.size();
+    auto hi = std::min<uint64_t>(lo + 99, sorted.size() - 1);
+    w.ranges.emplace_back(sorted[lo], sorted[hi]);
+  }
+  return w;
+}
+
+/// the bytes per key of a `C` built from the keys of `w`
+template <typename C>
+double memory_per_key(const Workload &w) {
+  C c;
+  // counts nothing of the destruction of `c`, which outlives it
+  AllocationCounter counter;
+  for (uint64_t i = 0; i < w.keys.size(); i++) {
+    c.insert(w.keys[i], i);
+  }
+  return static_cast<double>(counter.bytes()) / static_cast<double>(c.size());
+}
+
+template <typename C>
+void run(const Workload &w, Reporter &reporter) {
+  auto n = w.keys.size();
+  auto report = [&](std::string_view metric, double value,
+                    std::string_view unit) {
+    reporter.report(
+        fmt::format(R"("container": "{}", "distribution": "{}", "keys": {})",
+                    C::kName, w.distribution, n),
+        metric, value, unit);
+  };
+
+  report("memory", memory_per_key<C>(w), "bytes/key");
+
+  C c;
+  report("insert", time_per_op(n, [&] {
+           for (uint64_t i = 0; i < n; i++) {
+             c.insert(w.keys[i], i);
+           }
+         }),
+         "ns/op");
+
+  report("lookup", time_per_op(w.lookups.size(), [&] {
+           uint64_t sum = 0;
+           for (auto key : w.lookups) {
+             sum += c.get(key).value_or(0);
+           }
+           sink += sum;
+         }),
+         "ns/op");
+
+  report("range_scan_100", time_per_op(w.ranges.size(), [&] {
+           uint64_t sum = 0;
+           for (auto [lo, hi] : w.ranges) {
+             sum += c.scan(lo, hi);
+           }
+           sink += sum;
+         }),
+         "ns/op");
+
+  // a snapshot followed by a write, while the snapshot is still alive, so
+  // copy-on-write pays for its copy
+  auto rounds = std::clamp<uint64_t>(10'000'000 / n, 1, 1000);
+  report("snapshot_and_write", time_per_op(rounds, [&] {
+           for (uint64_t i = 0; i < rounds; i++) {
+             auto snapshot = c.snapshot();
+             c.insert(w.keys[i % n], i);
+           }
+         }),
+         "ns/op");
+
+  report("remove", time_per_op(n, [&] {
+           for (auto key : w.keys) {
+             c.remove(key);
+           }
+         }),
+         "ns/op");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  absl::SetProgramUsageMessage(
+      "benchmark the persistent RBTree against ordered maps");
+  absl::ParseCommandLine(argc, argv);
+
+  std::vector<uint64_t> sizes;
+  for (const auto &size : absl::GetFlag(FLAGS_sizes)) {
+    sizes.push_back(std::stoull(size));
+    if (sizes.back() == 0) {
+      fmt::print(stderr, "sizes must be at least 1\n");
+      return 1;
+    }
+  }
+
+  auto output = absl::GetFlag(FLAGS_output);
+  std::FILE *out = stdout;
+  if (!output.empty()) {
+    out = std::fopen(output.c_str(), "w");
+    if (!out) {
+      fmt::print(stderr, "can not open {}: {}\n", output, strerror(errno));
+      return 1;
+    }
+  }
+
+  {
+    Reporter reporter(out);
+    for (auto n : sizes) {
+      for (const auto &distribution : absl::GetFlag(FLAGS_distributions)) {
+        auto w = make_workload(distribution, n, absl::GetFlag(FLAGS_lookups),
+                               absl::GetFlag(FLAGS_seed));
+        for (const auto &container : absl::GetFlag(FLAGS_containers)) {
+          if (container == RBTreeBench::kName) {
+            run<RBTreeBench>(w, reporter);
+          } else if (container == StdMapBench::kName) {
+            run<StdMapBench>(w, reporter);
+          } else if (container == BtreeMapBench::kName) {
+            run<BtreeMapBench>(w, reporter);
+          } else if (container == CowMapBench::kName) {
+            run<CowMapBench>(w, reporter);
+          } else {
+            fmt::print(stderr, "unknown container {}\n", container);
+            return 1;
+          }
+        }
+      }
+    }
+  }
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+}
@@ -0,0 +1,131 @@
+#include "rbtree-history.hh"
+
+#include <gtest/gtest.h>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+
+using Map = std::map<uint64_t, uint64_t>;
+
+Map content(const RBTree &tree) {
+  Map map;
+  tree.for_each([&](uint64_t key, uint64_t value) { map[key] = value; });
+  return map;
+}
+
+}  // namespace
+
+TEST(RBTreeHistory, at) {
+  RBTreeHistory history(std::numeric_limits<uint64_t>::max());
+  EXPECT_FALSE(history.range().has_value());
+  EXPECT_EQ(history.at(0), nullptr);
+
+  std::mt19937_64 rng(1);
+  RBTree tree;
+  std::vector<Map> expected;
+  uint64_t max_size = 0;
+  uint64_t total_size = 0;
+  for (int version = 0; version < 50; version++) {
+    for (int i = 0; i < 100; i++) {
+      auto key = rng() % 2000;
+      if (rng() % 4 == 0) {
+        tree.remove(key);
+      } else {
+        tree.insert(key, rng());
+      }
+    }
+    EXPECT_EQ(history.commit(tree), expected.size());
+    expected.push_back(content(tree));
+    max_size = std::max(max_size, tree.size());
+    total_size += tree.size();
+  }
+
+  EXPECT_EQ(history.range(), std::pair(uint64_t{0}, uint64_t{49}));
+  for (uint64_t version = 0; version < expected.size(); version++) {
+    auto snapshot = history.at(version);
+    ASSERT_NE(snapshot, nullptr);
+    EXPECT_EQ(content(*snapshot), expected[version]);
+  }
+  EXPECT_EQ(history.at(50), nullptr);
+
+  // shared nodes are counted once
+  EXPECT_GE(history.live_nodes(), max_size);
+  EXPECT_LT(history.live_nodes(), total_size / 2);
+
+  // committing the same tree again pins nothing new
+  auto live = history.live_nodes();
+  history.commit(tree);
+  EXPECT_EQ(history.live_nodes(), live);
+
+  // dropping every older version leaves the nodes of the latest one
+  history.set_budget(0);
+  EXPECT_EQ(history.range(), std::pair(uint64_t{50}, uint64_t{50}));
+  EXPECT_EQ(history.live_nodes(), tree.size());
+  EXPECT_EQ(history.at(49), nullptr);
+  EXPECT_EQ(content(*history.at(50)), expected.back());
+}
+
+TEST(RBTreeHistory, budget) {
+  std::mt19937_64 rng(2);
+  RBTree tree;
+  for (uint64_t key = 0; key < 10000; key++) {
+    tree.insert(key, 0);
+  }
+  RBTreeHistory unbounded(std::numeric_limits<uint64_t>::max());
+  unbounded.commit(tree);
+  auto base_bytes = unbounded.live_bytes();
+
+  auto budget = base_bytes * 3 / 2;
+  RBTreeHistory history(budget);
+  uint64_t last = 0;
+  for (int version = 0; version < 200; version++) {
+    // value updates keep the latest version at the same size
+    for (int i = 0; i < 50; i++) {
+      tree.insert(rng() % 10000, version);
+    }
+    last = history.commit(tree);
+    EXPECT_LE(history.live_bytes(), budget);
+  }
+  auto [oldest, latest] = history.range().value();
+  EXPECT_EQ(latest, last);
+  EXPECT_GT(oldest, 0);
+  EXPECT_LT(oldest, latest);
+
+  // non-linear history: committing an older snapshot again
+  RBTree old = *history.at(oldest);
+  history.commit(old);
+  history.set_budget(0);
+  EXPECT_EQ(history.live_nodes(), old.size());
+}
+
+TEST(RBTreeHistory, held_snapshots) {
+  RBTree tree;
+  Map expected;
+  for (uint64_t key = 0; key < 1000; key++) {
+    tree.insert(key, 0);
+    expected[key] = 0;
+  }
+  RBTreeHistory history(0);
+  auto first = history.commit(tree);
+  auto held = history.at(first);
+
+  // new values for every key, the versions share no node
+  for (uint64_t key = 0; key < 1000; key++) {
+    tree.insert(key, 1);
+  }
+  auto second = history.commit(tree);
+  EXPECT_EQ(history.range(), std::pair(second, second));
+  EXPECT_EQ(history.at(first), nullptr);
+  EXPECT_EQ(history.held_versions(), 1);
+  EXPECT_EQ(history.live_nodes(), 2 * tree.size());
+  EXPECT_EQ(content(*held), expected);
+
+  // the evicted version is released once its reader drops it
+  held.reset();
+  history.commit(tree);
+  EXPECT_EQ(history.held_versions(), 0);
+  EXPECT_EQ(history.live_nodes(), tree.size());
+}
@@ -0,0 +1,195 @@
+#include "rbtree-log.hh"
+
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace {
+
+using Map = std::map<uint64_t, uint64_t>;
+
+std::string temp_path(const char *name) {
+  auto path = testing::TempDir() + name;
+  std::filesystem::remove(path);
+  return path;
+}
+
+void expect_version(const RBTreeLogReader &reader, size_t version,
+                    const Map &expected, uint64_t range) {
+  ASSERT_EQ(reader.size(version), expected.size());
+  for (uint64_t key = 0; key < range; key++) {
+    auto it = expected.find(key);
+    if (it == expected.end()) {
+      ASSERT_FALSE(reader.get(version, key).has_value()) << key;
+    } else {
+      ASSERT_EQ(reader.get(version, key), it->second) << key;
+    }
+  }
+  Map all;
+  reader.for_each(version, 0, std::numeric_limits<uint64_t>::max(),
+                  [&](uint64_t key, uint64_t value) { all[key] = value; });
+  ASSERT_EQ(all, expected);
+  Map part;
+  reader.for_each(version, range / 4, range / 2,
+                  [&](uint64_t key, uint64_t value) {
+                    EXPECT_TRUE(part.empty() || part.rbegin()->first < key);
+                    part[key] = value;
+                  });
+  ASSERT_EQ(part, Map(expected.lower_bound(range / 4),
+                      expected.upper_bound(range / 2)));
+}
+
+}  // namespace
+
+TEST(RBTreeLog, versions) {
+  auto path = temp_path("rbtree_log_versions");
+  std::mt19937_64 rng(3);
+  RBTree tree;
+  Map map;
+  std::vector<Map> expected;
+  {
+    RBTreeLogWriter writer(path);
+    for (int version = 0; version < 40; version++) {
+      auto before = std::filesystem::file_size(path);
+      auto changes = version == 0 ? 5000 : 10;
+      for (int i = 0; i < changes; i++) {
+        auto key = rng() % 8192;
+        if (rng() % 3 == 0) {
+          tree.remove(key);
+          map.erase(key);
+        } else {
+          tree.insert(key, rng());
+          map[key] = tree.get(key).value();
+        }
+      }
+      EXPECT_EQ(writer.append(tree), expected.size());
+      expected.push_back(map);
+      if (version > 0) {
+        // only the copied paths are appended
+        auto appended = std::filesystem::file_size(path) - before;
+        EXPECT_LE(appended, sizeof(rbtree_log::SegmentHeader) +
+                                sizeof(rbtree_log::NodeRecord) * changes * 2 *
+                                    14);
+      }
+    }
+    // an unchanged tree appends nothing but a header
+    auto before = std::filesystem::file_size(path);
+    writer.append(tree);
+    expected.push_back(map);
+    EXPECT_EQ(std::filesystem::file_size(path) - before,
+              sizeof(rbtree_log::SegmentHeader));
+  }
+
+  RBTreeLogReader reader(path);
+  ASSERT_EQ(reader.versions(), expected.size());
+  for (size_t version = 0; version < expected.size(); version++) {
+    expect_version(reader, version, expected[version], 8192);
+  }
+}
+
+TEST(RBTreeLog, reopen) {
+  auto path = temp_path("rbtree_log_reopen");
+  std::mt19937_64 rng(11);
+  RBTree tree;
+  Map map;
+  std::vector<Map> expected;
+  auto update = [&] {
+    for (int i = 0; i < 100; i++) {
+      auto key = rng() % 1024;
+      tree.insert(key, i);
+      map[key] = i;
+    }
+    expected.push_back(map);
+  };
+
+  {
+    RBTreeLogWriter writer(path);
+    update();
+    writer.append(RBTree());
+    expected.insert(expected.begin(), Map());
+    writer.append(tree);
+    update();
+    writer.append(tree);
+  }
+
+  // cut the last segment short, as a crash in the middle of append() would
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 40);
+  {
+    RBTreeLogReader reader(path);
+    ASSERT_EQ(reader.versions(), 2);
+  }
+  expected.pop_back();
+
+  {
+    RBTreeLogWriter writer(path);
+    EXPECT_EQ(writer.versions(), 2);
+    update();
+    EXPECT_EQ(writer.append(tree), 2);
+  }
+
+  RBTreeLogReader reader(path);
+  ASSERT_EQ(reader.versions(), expected.size());
+  for (size_t version = 0; version < expected.size(); version++) {
+    expect_version(reader, version, expected[version], 1024);
+  }
+  EXPECT_THROW(reader.get(expected.size(), 0), std::out_of_range);
+}
+
+TEST(RBTreeLog, corrupted_record) {
+  auto path = temp_path("rbtree_log_corrupted");
+  RBTree tree;
+  std::vector<Map> expected;
+  std::vector<uint64_t> ends;
+  {
+    RBTreeLogWriter writer(path);
+    Map map;
+    for (uint64_t version = 0; version < 3; version++) {
+      for (uint64_t key = version * 100; key < (version + 1) * 100; key++) {
+        tree.insert(key, key);
+        map[key] = key;
+      }
+      writer.append(tree);
+      expected.push_back(map);
+      ends.push_back(std::filesystem::file_size(path));
+    }
+  }
+
+  // a header which reached the disk with a record that didn't, in the
+  // middle segment
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(static_cast<std::streamoff>(
+        ends[0] + sizeof(rbtree_log::SegmentHeader) + 8));
+    file.put('\xff');
+  }
+  {
+    RBTreeLogReader reader(path);
+    ASSERT_EQ(reader.versions(), 1);
+    expect_version(reader, 0, expected[0], 300);
+  }
+
+  // the writer truncates the log at the first segment which fails
+  {
+    RBTreeLogWriter writer(path);
+    EXPECT_EQ(writer.versions(), 1);
+    EXPECT_EQ(std::filesystem::file_size(path), ends[0]);
+    EXPECT_EQ(writer.append(tree), 1);
+  }
+  RBTreeLogReader reader(path);
+  ASSERT_EQ(reader.versions(), 2);
+  expect_version(reader, 0, expected[0], 300);
+  expect_version(reader, 1, expected[2], 300);
+}
+
+TEST(RBTreeLog, not_a_log) {
+  auto path = temp_path("rbtree_log_garbage");
+  {
+    std::ofstream out(path);
+    out << std::string(64, 'x');
+  }
+  EXPECT_THROW(RBTreeLogReader{path}, std::runtime_error);
+  EXPECT_THROW(RBTreeLogWriter{path}, std::runtime_error);
+}
@@ -0,0 +1,601 @@
+#include "persistent-rbtree.hh"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Map = std::map<uint64_t, uint64_t>;
+
+std::pair<RBTree, Map> random_tree(std::mt19937_64 &rng, uint64_t n,
+                                   uint64_t range) {
+  RBTree tree;
+  Map map;
+  for (uint64_t i = 0; i < n; i++) {
+    auto key = rng() % range;
+    auto value = rng();
+    tree.insert(key, value);
+    map[key] = value;
+  }
+  return {tree, map};
+}
+
+void expect_content(const RBTree &tree, const Map &expected, uint64_t range) {
+  ASSERT_TRUE(tree.is_valid());
+  ASSERT_EQ(tree.size(), expected.size());
+  for (uint64_t key = 0; key < range; key++) {
+    auto it = expected.find(key);
+    if (it == expected.end()) {
+      ASSERT_FALSE(tree.get(key).has_value()) << key;
+    } else {
+      ASSERT_EQ(tree.get(key), it->second) << key;
+    }
+  }
+}
+
+}  // namespace
+
+TEST(RBTree, insert_remove) {
+  RBTree tree;
+  std::map<uint64_t, uint64_t> expected;
+  std::mt19937_64 rng(42);
+
+  for (int i = 0; i < 4000; i++) {
+    auto key = rng() % 1024;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(tree.remove(key), expected.erase(key) == 1);
+    } else {
+      tree.insert(key, i);
+      expected[key] = i;
+    }
+    ASSERT_TRUE(tree.is_valid());
+    ASSERT_EQ(tree.size(), expected.size());
+  }
+
+  for (uint64_t key = 0; key < 1024; key++) {
+    auto it = expected.find(key);
+    if (it == expected.end()) {
+      EXPECT_FALSE(tree.get(key).has_value());
+    } else {
+      EXPECT_EQ(tree.get(key), it->second);
+    }
+  }
+}
+
+TEST(RBTree, remove_last) {
+  RBTree tree;
+  tree.insert(0, 1);
+  EXPECT_TRUE(tree.remove(0));
+  EXPECT_TRUE(tree.empty());
+  EXPECT_FALSE(tree.get(0).has_value());
+  EXPECT_FALSE(tree.remove(0));
+  EXPECT_TRUE(tree.is_valid());
+}
+
+TEST(RBTree, snapshot) {
+  RBTree tree;
+  for (uint64_t i = 0; i < 100; i++) {
+    tree.insert(i, i);
+  }
+  auto snapshot = tree;
+  for (uint64_t i = 0; i < 100; i += 2) {
+    tree.remove(i);
+  }
+  tree.insert(1, 100);
+
+  EXPECT_EQ(snapshot.size(), 100);
+  EXPECT_EQ(tree.size(), 50);
+  EXPECT_TRUE(snapshot.is_valid());
+  for (uint64_t i = 0; i < 100; i++) {
+    EXPECT_EQ(snapshot.get(i), i);
+  }
+  EXPECT_EQ(tree.get(1), 100);
+}
+
+TEST(RBTree, order_statistic) {
+  std::mt19937_64 rng(3);
+  auto [tree, map] = random_tree(rng, 2000, 4000);
+  for (int i = 0; i < 500; i++) {
+    auto key = rng() % 4000;
+    tree.remove(key);
+    map.erase(key);
+  }
+  ASSERT_TRUE(tree.is_valid());
+
+  uint64_t i = 0;
+  for (auto [key, value] : map) {
+    EXPECT_EQ(tree.select(i), std::make_pair(key, value));
+    EXPECT_EQ(tree.rank(key), i);
+    i++;
+  }
+  EXPECT_FALSE(tree.select(map.size()).has_value());
+
+  for (int n = 0; n < 200; n++) {
+    auto lo = rng() % 4100;
+    auto hi = rng() % 4100;
+    auto expected =
+        lo > hi ? 0
+                : std::distance(map.lower_bound(lo), map.upper_bound(hi));
+    EXPECT_EQ(tree.count(lo, hi), expected) << lo << " " << hi;
+
+    Map range;
+    tree.for_each(lo, hi, [&](uint64_t key, uint64_t value) {
+      EXPECT_TRUE(range.empty() || range.rbegin()->first < key);
+      range[key] = value;
+    });
+    EXPECT_EQ(range, lo > hi ? Map() : Map(map.lower_bound(lo),
+                                           map.upper_bound(hi)));
+  }
+  EXPECT_EQ(tree.count(0, UINT64_MAX), map.size());
+  EXPECT_EQ(RBTree().count(0, UINT64_MAX), 0);
+}
+
+namespace {
+
+// polynomial hash of the keys in order, catches summaries combined out of order
+struct KeyHashMonoid {
+  struct value_type {
+    uint64_t hash;
+    uint64_t power;
+    bool operator==(const value_type &) const = default;
+  };
+  static constexpr uint64_t kBase = 1000003;
+  static value_type identity() {
+    return {0, 1};
+  }
+  static value_type lift(uint64_t key, uint64_t /*value*/) {
+    return {key, kBase};
+  }
+  static value_type combine(value_type a, value_type b) {
+    return {a.hash * b.power + b.hash, a.power * b.power};
+  }
+};
+
+template <typename Monoid, typename Tree>
+void expect_aggregates(std::mt19937_64 &rng, const Tree &tree, const Map &map,
+                       uint64_t range) {
+  for (int n = 0; n < 300; n++) {
+    auto lo = rng() % range;
+    auto hi = rng() % range;
+    auto expected = Monoid::identity();
+    for (auto it = map.lower_bound(lo); lo <= hi && it != map.upper_bound(hi);
+         ++it) {
+      expected = Monoid::combine(expected, Monoid::lift(it->first, it->second));
+    }
+    ASSERT_EQ(tree.aggregate(lo, hi), expected) << lo << " " << hi;
+  }
+  auto all = Monoid::identity();
+  for (auto [key, value] : map) {
+    all = Monoid::combine(all, Monoid::lift(key, value));
+  }
+  ASSERT_EQ(tree.summary(), all);
+}
+
+template <typename Monoid>
+void test_monoid() {
+  std::mt19937_64 rng(21);
+  BasicRBTree<Monoid> tree;
+  Map map;
+  for (int i = 0; i < 3000; i++) {
+    auto key = rng() % 2000;
+    if (rng() % 4 == 0) {
+      tree.remove(key);
+      map.erase(key);
+    } else {
+      auto value = rng() % 1000;
+      tree.insert(key, value);
+      map[key] = value;
+    }
+  }
+  ASSERT_TRUE(tree.is_valid());
+  expect_aggregates<Monoid>(rng, tree, map, 2100);
+
+  auto [left, value, right] = tree.split(1000);
+  auto joined = BasicRBTree<Monoid>::join(left, 1000, 7, right);
+  map[1000] = 7;
+  expect_aggregates<Monoid>(rng, joined, map, 2100);
+}
+
+}  // namespace
+
+TEST(RBTree, aggregate) {
+  test_monoid<SumMonoid>();
+  test_monoid<MinMonoid>();
+  test_monoid<MaxMonoid>();
+  test_monoid<KeyHashMonoid>();
+  static_assert(sizeof(BasicRBTree<>) == sizeof(void *));
+}
+
+TEST(RBTree, split_join) {
+  std::mt19937_64 rng(7);
+  auto [tree, map] = random_tree(rng, 3000, 5000);
+
+  for (uint64_t key : {0UL, 1UL, 777UL, 2500UL, 4999UL, 5000UL}) {
+    auto [left, value, right] = tree.split(key);
+    Map expected_left(map.begin(), map.lower_bound(key));
+    Map expected_right(map.upper_bound(key), map.end());
+    expect_content(left, expected_left, 5000);
+    expect_content(right, expected_right, 5000);
+    auto it = map.find(key);
+    EXPECT_EQ(value, it == map.end() ? std::nullopt
+                                     : std::optional<uint64_t>(it->second));
+
+    auto joined = RBTree::join(left, key, 42, right);
+    auto expected = map;
+    expected[key] = 42;
+    expect_content(joined, expected, 5001);
+  }
+
+  // joining trees of very different heights
+  RBTree small;
+  small.insert(10000, 1);
+  auto joined = RBTree::join(tree, 9999, 2, small);
+  map[9999] = 2;
+  map[10000] = 1;
+  expect_content(joined, map, 10001);
+}
+
+TEST(RBTree, set_operations) {
+  std::mt19937_64 rng(13);
+  for (auto [n, m] : {std::pair{0UL, 100UL},
+                      {100UL, 0UL},
+                      {10UL, 5000UL},
+                      {3000UL, 3000UL},
+                      {20000UL, 500UL}}) {
+    auto [a, map_a] = random_tree(rng, n, 30000);
+    auto [b, map_b] = random_tree(rng, m, 30000);
+
+    Map expected_union = map_a;
+    Map expected_intersection;
+    Map expected_difference;
+    for (auto [key, value] : map_b) {
+      expected_union[key] = value;
+      if (map_a.contains(key)) {
+        expected_intersection[key] = value;
+      }
+    }
+    for (auto [key, value] : map_a) {
+      if (!map_b.contains(key)) {
+        expected_difference[key] = value;
+      }
+    }
+
+    expect_content(RBTree::set_union(a, b), expected_union, 30000);
+    expect_content(RBTree::set_intersection(a, b), expected_intersection,
+                   30000);
+    expect_content(RBTree::set_difference(a, b), expected_difference, 30000);
+    // inputs are left untouched
+    expect_content(a, map_a, 30000);
+    expect_content(b, map_b, 30000);
+  }
+}
+
+TEST(RBTree, apply_batch) {
+  std::mt19937_64 rng(21);
+  for (auto [n, k] : {std::pair{0UL, 100UL},
+                      {1000UL, 0UL},
+                      {1000UL, 1UL},
+                      {5000UL, 300UL},
+                      {200UL, 20000UL}}) {
+    auto [tree, map] = random_tree(rng, n, 30000);
+    Map batch;
+    for (uint64_t i = 0; i < k; i++) {
+      batch[rng() % 30000] = rng() % 3 == 0 ? 0 : rng() | 1;
+    }
+    std::vector<RBTree::Update> updates;
+    auto expected = map;
+    for (auto [key, value] : batch) {
+      if (value == 0) {
+        updates.push_back({key, std::nullopt});
+        expected.erase(key);
+      } else {
+        updates.push_back({key, value});
+        expected[key] = value;
+      }
+    }
+
+    auto updated = tree;
+    updated.apply_batch(updates);
+    expect_content(updated, expected, 30000);
+    expect_content(tree, map, 30000);
+  }
+}
+
+TEST(RBTree, diff) {
+  std::mt19937_64 rng(99);
+  auto [base, base_map] = random_tree(rng, 5000, 10000);
+
+  for (int changes : {0, 1, 10, 300, 5000}) {
+    auto tree = base;
+    auto map = base_map;
+    for (int i = 0; i < changes; i++) {
+      auto key = rng() % 10000;
+      if (rng() % 2 == 0) {
+        tree.remove(key);
+        map.erase(key);
+      } else {
+        auto value = rng() % 4;
+        tree.insert(key, value);
+        map[key] = value;
+      }
+    }
+
+    Map added;
+    Map removed;
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> changed;
+    uint64_t last_key = 0;
+    bool first = true;
+    auto check_order = [&](uint64_t key) {
+      EXPECT_TRUE(first || key > last_key);
+      first = false;
+      last_key = key;
+    };
+    RBTree::diff(
+        base, tree,
+        [&](uint64_t key, uint64_t value) {
+          check_order(key);
+          added[key] = value;
+        },
+        [&](uint64_t key, uint64_t value) {
+          check_order(key);
+          removed[key] = value;
+        },
+        [&](uint64_t key, uint64_t old_value, uint64_t new_value) {
+          check_order(key);
+          changed[key] = {old_value, new_value};
+        });
+
+    Map expected_added;
+    Map expected_removed;
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> expected_changed;
+    for (auto [key, value] : map) {
+      auto it = base_map.find(key);
+      if (it == base_map.end()) {
+        expected_added[key] = value;
+      } else if (it->second != value) {
+        expected_changed[key] = {it->second, value};
+      }
+    }
+    for (auto [key, value] : base_map) {
+      if (!map.contains(key)) {
+        expected_removed[key] = value;
+      }
+    }
+    EXPECT_EQ(added, expected_added);
+    EXPECT_EQ(removed, expected_removed);
+    EXPECT_EQ(changed, expected_changed);
+  }
+
+  // unrelated trees with the same content have no differences
+  RBTree copy;
+  base.for_each([&](uint64_t key, uint64_t value) { copy.insert(key, value); });
+  int reported = 0;
+  auto count = [&](auto...) { reported++; };
+  RBTree::diff(base, copy, count, count, count);
+  EXPECT_EQ(reported, 0);
+}
+
+TEST(RBTree, reconcile) {
+  using MerkleTree = BasicRBTree<MerkleMonoid>;
+  std::mt19937_64 rng(5);
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  for (int i = 0; i < 20000; i++) {
+    entries.emplace_back(rng() % 1000000, rng());
+  }
+
+  // replicas built in different orders share no nodes
+  MerkleTree a;
+  MerkleTree b;
+  for (auto [key, value] : entries) {
+    a.insert(key, value);
+  }
+  std::shuffle(entries.begin(), entries.end(), rng);
+  for (auto [key, _] : entries) {
+    // duplicate keys take the value `a` ended up with
+    b.insert(key, a.get(key).value());
+  }
+  EXPECT_EQ(a.summary(), b.summary());
+
+  std::set<uint64_t> changed;
+  for (int i = 0; i < 20; i++) {
+    auto key = entries[rng() % entries.size()].first;
+    if (i % 2 == 0) {
+      b.remove(key);
+    } else {
+      b.insert(key, rng());
+    }
+    b.insert(rng() % 1000000, rng());
+    changed.insert(key);
+  }
+  ASSERT_NE(a.summary(), b.summary());
+
+  uint64_t covered = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  MerkleTree::reconcile(a, b, [&](uint64_t lo, uint64_t hi) {
+    EXPECT_TRUE(ranges.empty() || ranges.back().second < lo);
+    ranges.emplace_back(lo, hi);
+    covered += std::max(a.count(lo, hi), b.count(lo, hi));
+  });
+  // every difference is in a reported range
+  std::vector<uint64_t> differences;
+  a.for_each([&](uint64_t key, uint64_t value) {
+    if (b.get(key) != value) {
+      differences.push_back(key);
+    }
+  });
+  b.for_each([&](uint64_t key, uint64_t) {
+    if (!a.get(key)) {
+      differences.push_back(key);
+    }
+  });
+  EXPECT_GE(differences.size(), changed.size());
+  for (auto key : differences) {
+    EXPECT_TRUE(std::any_of(ranges.begin(), ranges.end(), [&](auto range) {
+      return range.first <= key && key <= range.second;
+    })) << key;
+  }
+  EXPECT_LE(covered, differences.size() * MerkleTree::kReconcileRange);
+
+  int reported = 0;
+  MerkleTree::reconcile(a, a, [&](auto...) { reported++; });
+  EXPECT_EQ(reported, 0);
+}
+
+TEST(RBTree, stats) {
+  std::mt19937_64 rng(17);
+  auto [tree, map] = random_tree(rng, 10000, 1000000);
+  auto stats = tree.stats();
+  EXPECT_EQ(stats.nodes, tree.size());
+  EXPECT_GT(stats.bytes, 0);
+  EXPECT_GE(stats.height, 14);
+  EXPECT_LE(stats.height, 2 * 14);
+  EXPECT_LE(stats.black_height, stats.height);
+  EXPECT_GE(2 * stats.black_height, stats.height);
+  EXPECT_EQ(RBTree().stats().height, 0);
+
+  // one insert copies a single path
+  auto next = tree;
+  next.insert(1000001, 0);
+  std::vector<RBTree> versions{tree, next};
+  auto sharing = RBTree::sharing(versions);
+  EXPECT_EQ(sharing.versions, 2);
+  EXPECT_EQ(sharing.logical_nodes, 2 * tree.size() + 1);
+  EXPECT_EQ(sharing.logical_nodes, sharing.unique_nodes + sharing.shared_nodes);
+  EXPECT_LE(sharing.unique_nodes - tree.size(), stats.height + 1);
+  EXPECT_EQ(sharing.bytes, sharing.unique_nodes * stats.bytes / stats.nodes);
+
+  // the same version twice shares everything, unrelated trees nothing
+  versions = {tree, tree};
+  EXPECT_EQ(RBTree::sharing(versions).shared_nodes, tree.size());
+  auto [other, _] = random_tree(rng, 500, 1000);
+  versions = {tree, next};
+  auto without_other = RBTree::sharing(versions).unique_nodes;
+  versions = {tree, other, next};
+  sharing = RBTree::sharing(versions);
+  EXPECT_EQ(sharing.unique_nodes, without_other + other.size());
+
+  std::map<std::string, uint64_t> counters;
+  sharing.for_each_counter(
+      [&](const char *name, uint64_t value) { counters[name] = value; });
+  EXPECT_EQ(counters["shared_nodes"], sharing.shared_nodes);
+}
+
+TEST(ConcurrentRBTree, readers) {
+  ConcurrentRBTree tree;
+  constexpr uint64_t kKeys = 2000;
+  std::atomic<bool> done = false;
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 8; i++) {
+    readers.emplace_back([&] {
+      while (!done.load()) {
+        // keys are inserted in order, so a snapshot holding key `n` must hold
+        // every key below it as well
+        auto snapshot = tree.snapshot();
+        auto n = snapshot->size();
+        ASSERT_TRUE(n == 0 || snapshot->get(n - 1) == n - 1);
+        ASSERT_FALSE(snapshot->get(n).has_value());
+      }
+    });
+  }
+
+  for (uint64_t key = 0; key < kKeys; key++) {
+    tree.insert(key, key);
+  }
+  done = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+
+  auto snapshot = tree.snapshot();
+  EXPECT_EQ(snapshot->size(), kKeys);
+  EXPECT_TRUE(snapshot->is_valid());
+  EXPECT_TRUE(tree.remove(0));
+  EXPECT_FALSE(tree.get(0).has_value());
+  EXPECT_EQ(snapshot->get(0), 0);
+}
+
+TEST(ConcurrentRBTree, readers_never_wait) {
+  ConcurrentRBTree tree;
+  tree.insert(1, 1);
+  constexpr int kReaders = 4;
+  constexpr int kReads = 1000;
+  std::atomic<bool> writing = false;
+  std::atomic<bool> release = false;
+  std::atomic<int> reads = 0;
+
+  // the writer holds the writer lock until the readers are done or time out
+  std::thread writer([&] {
+    tree.update([&](RBTree &next) {
+      next.insert(2, 2);
+      writing = true;
+      while (!release.load()) {
+        std::this_thread::yield();
+      }
+    });
+  });
+  while (!writing.load()) {
+    std::this_thread::yield();
+  }
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < kReaders; i++) {
+    readers.emplace_back([&] {
+      for (int j = 0; j < kReads && !release.load(); j++) {
+        auto snapshot = tree.snapshot();
+        EXPECT_EQ(snapshot->get(1), 1);
+        EXPECT_FALSE(snapshot->get(2).has_value());
+        reads++;
+      }
+    });
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (reads.load() < kReaders * kReads &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(reads.load(), kReaders * kReads);
+  release = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+  writer.join();
+  EXPECT_EQ(tree.get(2), 2);
+}
+
+TEST(ConcurrentRBTree, reclaim) {
+  ConcurrentRBTree tree;
+  tree.insert(0, 0);
+  EXPECT_EQ(tree.retired(), 0);
+
+  // a pinned snapshot keeps every version retired after it alive
+  std::atomic<bool> pinned = false;
+  std::atomic<bool> release = false;
+  std::thread reader([&] {
+    auto snapshot = tree.snapshot();
+    pinned = true;
+    while (!release.load()) {
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(snapshot->size(), 1);
+    EXPECT_TRUE(snapshot->is_valid());
+  });
+  while (!pinned.load()) {
+    std::this_thread::yield();
+  }
+  for (uint64_t key = 1; key <= 100; key++) {
+    tree.insert(key, key);
+  }
+  EXPECT_EQ(tree.retired(), 100);
+
+  release = true;
+  reader.join();
+  tree.insert(101, 101);
+  EXPECT_EQ(tree.retired(), 0);
+  EXPECT_EQ(tree.snapshot()->size(), 102);
+}
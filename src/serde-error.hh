@@ -0,0 +1,291 @@
+#pragma once
+
+#include <fmt/format.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <source_location>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "outcome.hh"
+#include "serde.hh"
+
+/**
+ * Errors on the wire, so that a failure crosses a process boundary with its
+ * domain and value instead of as a formatted message:
+ *
+ *   uint domain, int value, uint flags, [str payload], [str file, uint line]
+ *
+ * `domain` is the payload uuid of the enum, shared by EnumPayloadError and
+ * the quick status codes of the enum, which decode as EnumPayloadError. The
+ * payload is serialized into a string of its own, so a reader which doesn't
+ * know the domain can skip it. The location is the file name and line only.
+ *
+ * A std::source_location can't be built from parts, so the decoded error
+ * is located at the decoding call and wrapped in a ContextError carrying the
+ * remote file and line. Errors of domains nobody registered are sent as
+ * their message, and values the enum of a known domain doesn't have, e.g.
+ * from a peer built with a newer enum, decode as Anyhow errors.
+ */
+class ErrorRegistry {
+public:
+  using StatusCode = SYSTEM_ERROR2_NAMESPACE::status_code<void>;
+  using SystemCode = SYSTEM_ERROR2_NAMESPACE::system_code;
+  template <typename Enum, typename Payload>
+  using EnumPayloadError =
+      SYSTEM_ERROR2_NAMESPACE::EnumPayloadError<Enum, Payload>;
+
+  enum Flags : uint64_t {
+    kPayload = 1,
+    kLocation = 2,
+    kMessage = 4,  // the payload is the message of an unregistered error
+  };
+
+  ErrorRegistry() = default;
+  ErrorRegistry(const ErrorRegistry &) = delete;
+  ErrorRegistry &operator=(const ErrorRegistry &) = delete;
+
+  /// knows GenericErrc and generic_code from the start
+  static ErrorRegistry &global();
+
+  /// make the errors of `Enum` carrying a `Payload` (or none for void) and
+  /// the quick status codes of `Enum` encodable and decodable
+  template <typename Enum, typename Payload = void>
+  void add();
+
+  template <typename Enum, typename Payload>
+  static void encode(Serializer &serializer,
+                     const EnumPayloadError<Enum, Payload> &error) {
+    const auto &v = error.value();
+    if constexpr (std::is_void_v<Payload>) {
+      write(serializer, domain_of<Enum>(), static_cast<int64_t>(v.value), 0,
+            {}, &v.loc);
+    } else {
+      Serializer payload;
+      serialize(payload, v.payload);
+      write(serializer, domain_of<Enum>(), static_cast<int64_t>(v.value),
+            kPayload, payload.buffer, &v.loc);
+    }
+  }
+
+  /// encode an erased error, context() frames are not sent
+  void encode(Serializer &serializer, const StatusCode &code) const {
+    using SYSTEM_ERROR2_NAMESPACE::ContextError;
+    using SYSTEM_ERROR2_NAMESPACE::IndirectCode;
+    if (code.empty()) {
+      write(serializer, 0, 0, 0, {}, nullptr);
+      return;
+    }
+    if (SYSTEM_ERROR2_NAMESPACE::is_nested_context(code)) {
+      const auto &c =
+          static_cast<const IndirectCode<ContextError> &>(code);  // NOLINT
+      encode(serializer, c.value()->sc.value().error);
+      return;
+    }
+    Encoder encoder = nullptr;
+    {
+      std::shared_lock lock(mutex_);
+      if (auto it = encoders_.find(&code.domain()); it != encoders_.end()) {
+        encoder = it->second;
+      }
+    }
+    if (encoder) {
+      encoder(serializer, code);
+      return;
+    }
+    auto message = code.message();
+    Serializer payload;
+    payload.write_str(std::string_view(message.data(), message.size()));
+    write(serializer, code.domain().id(), 0, kPayload | kMessage,
+          payload.buffer, nullptr);
+  }
+
+  SystemCode decode(
+      Deserializer &deserializer,
+      std::source_location loc = std::source_location::current()) const;
+
+private:
+  using Encoder = void (*)(Serializer &, const StatusCode &);
+  using Decoder = SystemCode (*)(int64_t value, std::string_view payload,
+                                 const std::source_location &loc);
+
+  struct Decoders {
+    Decoder plain = nullptr;
+    Decoder payload = nullptr;
+  };
+
+  template <typename Enum>
+  static uint64_t domain_of() {
+    return SYSTEM_ERROR2_NAMESPACE::EnumPayloadDomainImpl<Enum,
+                                                          void>::payload_uuid;
+  }
+
+  static void write(Serializer &serializer, uint64_t domain, int64_t value,
+                    uint64_t flags, std::string_view payload,
+                    const std::source_location *loc) {
+    serializer.write_uint(domain);
+    serializer.write_int(value);
+    serializer.write_uint(loc ? flags | kLocation : flags);
+    if (flags & kPayload) {
+      serializer.write_str(payload);
+    }
+    if (loc) {
+      std::string_view file{loc->file_name()};
+      serializer.write_str(file.substr(file.find_last_of('/') + 1));
+      serializer.write_uint(loc->line());
+    }
+  }
+
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<const SYSTEM_ERROR2_NAMESPACE::status_code_domain *,
+                     Encoder>
+      encoders_;
+  std::unordered_map<uint64_t, Decoders> decoders_;
+};
+
+template <typename Enum, typename Payload>
+void ErrorRegistry::add() {
+  using SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_code;
+  using SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum_domain;
+  using Error = EnumPayloadError<Enum, Payload>;
+
+  if constexpr (!std::is_void_v<Payload>) {
+    add<Enum>();
+  }
+
+  // the indirecting domain of Error has no name outside of an erased code
+  typename Error::value_type probe_value{};
+  SystemCode probe = make_status_code(Error(std::move(probe_value)));
+
+  Encoder nested = [](Serializer &serializer, const StatusCode &code) {
+    using SYSTEM_ERROR2_NAMESPACE::IndirectCode;
+    const auto &c = static_cast<const IndirectCode<Error> &>(code);  // NOLINT
+    encode(serializer, c.value()->sc);
+  };
+  Encoder quick = [](Serializer &serializer, const StatusCode &code) {
+    using QuickCode = quick_status_code_from_enum_code<Enum>;
+    const auto &c = static_cast<const QuickCode &>(code);  // NOLINT
+    write(serializer, domain_of<Enum>(), static_cast<int64_t>(c.value()), 0,
+          {}, nullptr);
+  };
+  Decoder decoder = [](int64_t value, std::string_view payload,
+                       const std::source_location &loc) -> SystemCode {
+    using SYSTEM_ERROR2_NAMESPACE::EnumValueBase;
+    using SYSTEM_ERROR2_NAMESPACE::quick_status_code_from_enum;
+    // a value the underlying type can't hold is no value of Enum either
+    bool known =
+        std::in_range<std::underlying_type_t<Enum>>(value) &&
+        EnumValueBase<Enum>::find_mapping(static_cast<Enum>(value));
+    if (!known) {
+      return make_error(
+          fmt::format("unknown {} value {}",
+                      quick_status_code_from_enum<Enum>::domain_name, value),
+          loc);
+    }
+    auto e = static_cast<Enum>(value);
+    if constexpr (std::is_void_v<Payload>) {
+      (void)payload;
+      return make_status_code(Error({e, loc}));
+    } else {
+      typename Error::value_type v{e, {}, loc};
+      Deserializer deserializer{payload};
+      deserialize(deserializer, v.payload);
+      return make_status_code(Error(std::move(v)));
+    }
+  };
+
+  std::unique_lock lock(mutex_);
+  encoders_[&probe.domain()] = nested;
+  encoders_[&quick_status_code_from_enum_domain<Enum>] = quick;
+  auto &decoders = decoders_[domain_of<Enum>()];
+  (std::is_void_v<Payload> ? decoders.plain : decoders.payload) = decoder;
+}
+
+inline ErrorRegistry &ErrorRegistry::global() {
+  static ErrorRegistry *registry = [] {
+    auto *r = new ErrorRegistry;
+    r->add<GenericErrc>();
+    std::unique_lock lock(r->mutex_);
+    r->encoders_[&SYSTEM_ERROR2_NAMESPACE::generic_code_domain] =
+        [](Serializer &serializer, const StatusCode &code) {
+          using SYSTEM_ERROR2_NAMESPACE::generic_code;
+          const auto &c = static_cast<const generic_code &>(code);  // NOLINT
+          write(serializer, domain_of<GenericErrc>(),
+                static_cast<int64_t>(c.value()), 0, {}, nullptr);
+        };
+    return r;
+  }();
+  return *registry;
+}
+
+inline ErrorRegistry::SystemCode ErrorRegistry::decode(
+    Deserializer &deserializer, std::source_location loc) const {
+  auto domain = deserializer.read_uint();
+  auto value = deserializer.read_int();
+  auto flags = deserializer.read_uint();
+  std::string_view payload;
+  if (flags & kPayload) {
+    payload = deserializer.read_str();
+  }
+  std::string_view file;
+  uint64_t line = 0;
+  if (flags & kLocation) {
+    file = deserializer.read_str();
+    line = deserializer.read_uint();
+  }
+  if (domain == 0) {
+    return {};
+  }
+
+  Decoder decoder = nullptr;
+  {
+    std::shared_lock lock(mutex_);
+    if (auto it = decoders_.find(domain); it != decoders_.end()) {
+      decoder = (flags & kPayload) && it->second.payload ? it->second.payload
+                                                         : it->second.plain;
+    }
+  }
+  SystemCode code;
+  if (decoder) {
+    code = decoder(value, payload, loc);
+  } else if (flags & kMessage) {
+    Deserializer message{payload};
+    code = make_error(std::string(message.read_str()), loc);
+  } else {
+    code = make_error(
+        fmt::format("unknown error domain {:016x} value {}", domain, value),
+        loc);
+  }
+  if (!(flags & kLocation)) {
+    return code;
+  }
+  using SYSTEM_ERROR2_NAMESPACE::ContextDomainImpl;
+  using SYSTEM_ERROR2_NAMESPACE::ContextError;
+  return ContextError(
+      SYSTEM_ERROR2_NAMESPACE::in_place, std::move(code),
+      ContextDomainImpl::RemoteLocation{std::string(file),
+                                        static_cast<uint32_t>(line)});
+}
+
+template <typename Enum, typename Payload>
+void serialize(Serializer &serializer,
+               const SYSTEM_ERROR2_NAMESPACE::EnumPayloadError<Enum, Payload>
+                   &error) {
+  ErrorRegistry::encode(serializer, error);
+}
+
+/// through ErrorRegistry::global(), e.g. the error of a Result
+inline void serialize(Serializer &serializer,
+                      const SYSTEM_ERROR2_NAMESPACE::status_code<void> &code) {
+  ErrorRegistry::global().encode(serializer, code);
+}
+
+/// the error is located at the caller, see ErrorRegistry
+inline void deserialize(
+    Deserializer &deserializer, SYSTEM_ERROR2_NAMESPACE::system_code &code,
+    std::source_location loc = std::source_location::current()) {
+  code = ErrorRegistry::global().decode(deserializer, loc);
+}
@@ -1,4 +1,5 @@
 #include "serde.hh"
+#include "serde-error.hh"
 
 #include <fmt/core.h>
 #include <gtest/gtest.h>
@@ -383,3 +384,122 @@ TEST(NonAggregate, serde) {
   deserialize(deserializer, value);
   EXPECT_EQ(value, input);
 }
+
+enum class WireErrc { busy = 1, gone = 2 };
+
+QUICK_STATUS_CODE(WireErrc, busy, gone)
+
+TEST(Error, enum_payload) {
+  ErrorRegistry::global().add<WireErrc, std::string>();
+  using SYSTEM_ERROR2_NAMESPACE::system_code;
+
+  Serializer serializer;
+  serialize(serializer, make_error(WireErrc::gone, "disk"));
+  serialize(serializer, make_error(WireErrc::busy));
+  Result<void> quick = WireErrc::busy;
+  serialize(serializer, quick.error());
+  Result<void> nested = make_error(WireErrc::gone, "net");
+  serialize(serializer, nested.error());
+  auto s = serializer.take();
+
+  Deserializer deserializer(s);
+  system_code gone;
+  deserialize(deserializer, gone);
+  EXPECT_EQ(gone, make_error(WireErrc::gone));
+  auto m = gone.message();
+  std::string_view message{m.data(), m.size()};
+  EXPECT_NE(message.find("from serde_test.cc:"), std::string_view::npos)
+      << message;
+  EXPECT_TRUE(message.ends_with(" gone disk")) << message;
+
+  system_code busy;
+  deserialize(deserializer, busy);
+  EXPECT_EQ(busy, make_error(WireErrc::busy));
+  system_code quick_busy;
+  deserialize(deserializer, quick_busy);
+  EXPECT_EQ(quick_busy, make_error(WireErrc::busy));
+  system_code net;
+  deserialize(deserializer, net);
+  m = net.message();
+  EXPECT_TRUE(std::string_view(m.data(), m.size()).ends_with(" gone net"));
+  EXPECT_EQ(deserializer.pos, s.size());
+}
+
+TEST(Error, generic) {
+  using SYSTEM_ERROR2_NAMESPACE::errc;
+  using SYSTEM_ERROR2_NAMESPACE::generic_code;
+  using SYSTEM_ERROR2_NAMESPACE::system_code;
+
+  Serializer serializer;
+  serialize(serializer, make_error(GenericErrc::timed_out));
+  serialize(serializer, generic_code(errc::no_such_file_or_directory));
+  Result<void> failed = context(Result<void>(make_error("anyhow")), "outer");
+  serialize(serializer, failed.error());
+  auto s = serializer.take();
+
+  Deserializer deserializer(s);
+  system_code timed_out;
+  deserialize(deserializer, timed_out);
+  EXPECT_EQ(timed_out, generic_code(errc::timed_out));
+  system_code no_entry;
+  deserialize(deserializer, no_entry);
+  EXPECT_EQ(no_entry, generic_code(errc::no_such_file_or_directory));
+
+  // unregistered domains arrive as their message
+  system_code anyhow;
+  deserialize(deserializer, anyhow);
+  auto m = anyhow.message();
+  EXPECT_TRUE(std::string_view(m.data(), m.size()).ends_with(" anyhow"));
+  EXPECT_EQ(deserializer.pos, s.size());
+}
+
+TEST(Error, unknown_value) {
+  ErrorRegistry::global().add<WireErrc>();
+  using SYSTEM_ERROR2_NAMESPACE::system_code;
+  using Domain = SYSTEM_ERROR2_NAMESPACE::EnumPayloadDomainImpl<WireErrc, void>;
+
+  // a peer with a newer WireErrc
+  Serializer serializer;
+  serializer.write_uint(Domain::payload_uuid);
+  serializer.write_int(99);
+  serializer.write_uint(ErrorRegistry::kLocation);
+  serializer.write_str("peer.cc");
+  serializer.write_uint(7);
+  auto s = serializer.take();
+
+  Deserializer deserializer(s);
+  system_code code;
+  deserialize(deserializer, code);
+  EXPECT_TRUE(code.failure());
+  EXPECT_NE(code, make_error(WireErrc::busy));
+  auto m = code.message();
+  std::string_view message{m.data(), m.size()};
+  EXPECT_TRUE(message.starts_with("from peer.cc:7: ")) << message;
+  EXPECT_TRUE(message.ends_with(" unknown WireErrc value 99")) << message;
+  EXPECT_EQ(deserializer.pos, s.size());
+
+}
+
+TEST(Error, value_out_of_range) {
+  ErrorRegistry::global().add<WireErrc>();
+  using SYSTEM_ERROR2_NAMESPACE::system_code;
+  using Domain = SYSTEM_ERROR2_NAMESPACE::EnumPayloadDomainImpl<WireErrc, void>;
+
+  // truncated to the int of WireErrc this would read as gone
+  Serializer serializer;
+  serializer.write_uint(Domain::payload_uuid);
+  serializer.write_int((int64_t(1) << 32) + 2);
+  serializer.write_uint(0);
+  auto s = serializer.take();
+
+  Deserializer deserializer(s);
+  system_code code;
+  deserialize(deserializer, code);
+  EXPECT_TRUE(code.failure());
+  EXPECT_NE(code, make_error(WireErrc::gone));
+  auto m = code.message();
+  std::string_view message{m.data(), m.size()};
+  EXPECT_TRUE(message.ends_with(" unknown WireErrc value 4294967298"))
+      << message;
+  EXPECT_EQ(deserializer.pos, s.size());
+}